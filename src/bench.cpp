@@ -0,0 +1,368 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <span>
+#include <string>
+#include <vector>
+
+#include <linux/perf_event.h>
+#include <omp.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <LiteMath/LiteMath.h>
+
+#include <brick_raytracing.hpp>
+#include <camera.hpp>
+#include <grid_raytracing.hpp>
+#include <octree_raytracing.hpp>
+#include <raytracing.hpp>
+#include <scene_loader.hpp>
+#include <triangles_raytracing.hpp>
+
+using namespace LiteMath;
+
+// Headless renderer benchmark. Renders every model from the resources
+// directory with a fixed set of camera poses, resolutions and shading modes
+// and prints the results as JSON to stdout. Loader logs go to stderr.
+//
+// usage: rt_bench [resources_dir] [--frames N] [--storage 32|16|8]
+//                 [--grid-layout linear|tiled] [--relaxation W]
+//                 [--ray-cones] [--ropes]
+//
+// --storage selects the SDF value storage of grids and octrees, quantization
+// errors are reported by the loaders on stderr. --relaxation W > 1 switches
+// grids and octrees to over-relaxed sphere tracing with step scale W.
+// --ray-cones traces primary rays with pixel cones, octrees then stop at
+// nodes below the pixel footprint. --ropes steps octree rays from leaf to
+// leaf along neighbour links instead of descending from the root.
+
+struct BenchCamera {
+  const char *name;
+  float3 position;
+};
+
+struct BenchResolution {
+  int width;
+  int height;
+};
+
+struct BenchMode {
+  const char *name;
+  ShadingMode mode;
+};
+
+const BenchCamera BENCH_CAMERAS[] = {
+    {"front", float3{0.0f, 0.0f, 2.5f}},
+    {"side", float3{2.5f, 0.0f, 0.0f}},
+    {"diagonal", float3{1.5f, 1.5f, 1.5f}},
+    {"close", float3{0.0f, 0.3f, 1.2f}},
+};
+
+constexpr BenchResolution BENCH_RESOLUTIONS[] = {
+    {640, 360}, {1280, 720}, {1920, 1080}};
+
+struct BenchGridConfig {
+  const char *name;
+  bool skipEmptySpace;
+  SDFGridIntersection intersection;
+};
+
+// grids are measured with every intersection setup
+constexpr BenchGridConfig BENCH_GRID_CONFIGS[] = {
+    {"sphere_tracing", false, SDFGridIntersection::SphereTracing},
+    {"sphere_tracing_skip", true, SDFGridIntersection::SphereTracing},
+    {"exact_cells_skip", true, SDFGridIntersection::ExactCells}};
+
+constexpr BenchMode BENCH_MODES[] = {{"Color", ShadingMode::Color},
+                                     {"Lambert", ShadingMode::Lambert},
+                                     {"Normal", ShadingMode::Normal}};
+
+// Counts hardware cache misses (usually last level ones) of the OpenMP
+// worker threads. Unavailable when perf events are not permitted.
+class CacheMissCounter {
+public:
+  CacheMissCounter() {
+    m_fds.assign(static_cast<size_t>(omp_get_max_threads()), -1);
+    // counters belong to threads, so every worker opens its own one
+#pragma omp parallel
+    {
+      perf_event_attr attr = {};
+      attr.type = PERF_TYPE_HARDWARE;
+      attr.size = sizeof(attr);
+      attr.config = PERF_COUNT_HW_CACHE_MISSES;
+      attr.disabled = 1;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      m_fds[static_cast<size_t>(omp_get_thread_num())] = static_cast<int>(
+          syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+  }
+  CacheMissCounter(const CacheMissCounter &) = delete;
+  CacheMissCounter &operator=(const CacheMissCounter &) = delete;
+  ~CacheMissCounter() {
+    for (int fd : m_fds) {
+      if (fd >= 0) {
+        close(fd);
+      }
+    }
+  }
+
+  bool available() const noexcept {
+    return std::all_of(m_fds.begin(), m_fds.end(),
+                       [](int fd) { return fd >= 0; });
+  }
+  void start() {
+    for (int fd : m_fds) {
+      ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+  uint64_t stop() {
+    uint64_t total = 0;
+    for (int fd : m_fds) {
+      ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+      uint64_t count = 0;
+      if (read(fd, &count, sizeof(count)) == sizeof(count)) {
+        total += count;
+      }
+    }
+    return total;
+  }
+
+private:
+  std::vector<int> m_fds;
+};
+
+static float percentile(std::vector<float> values, float p) {
+  std::sort(values.begin(), values.end());
+  auto index = static_cast<size_t>(p * static_cast<float>(values.size() - 1) +
+                                   0.5f);
+  return values[std::min(index, values.size() - 1)];
+}
+
+static std::shared_ptr<IScene> loadScene(const std::filesystem::path &path,
+                                         SDFStorage storage,
+                                         SDFGridLayout gridLayout,
+                                         float relaxation, bool useRopes,
+                                         BBox3f &modelBox) {
+  MarchPolicy marchPolicy =
+      relaxation > 1.0f ? MarchPolicy::OverRelaxed : MarchPolicy::Plain;
+  modelBox.boxMin = float3{-1.0f};
+  modelBox.boxMax = float3{1.0f};
+  if (path.extension() == ".obj") {
+    auto mesh = loadAndScale(path);
+    modelBox = calc_bbox(mesh);
+    auto pBVH = std::make_shared<BVHBuilder>();
+    pBVH->perform(std::move(mesh));
+    return pBVH;
+  } else if (path.extension() == ".grid") {
+    auto pGrid = std::make_shared<SDFGrid>();
+    loadSDFGrid(*pGrid, path.string());
+    pGrid->setLayout(gridLayout);
+    pGrid->quantize(storage);
+    pGrid->marchPolicy = marchPolicy;
+    pGrid->relaxation = relaxation;
+    return pGrid;
+  } else if (path.extension() == ".bricks") {
+    auto pBricks = std::make_shared<SDFBrickGrid>();
+    loadSDFBrickGrid(*pBricks, path.string());
+    return pBricks;
+  } else if (path.extension() == ".octree") {
+    auto pOctree = std::make_shared<SDFOctree>();
+    loadSDFOctree(*pOctree, path.string());
+    pOctree->quantize(storage);
+    pOctree->marchPolicy = marchPolicy;
+    pOctree->relaxation = relaxation;
+    if (useRopes) {
+      pOctree->buildRopes();
+      pOctree->traversal = OctreeTraversal::Ropes;
+    }
+    return pOctree;
+  }
+  return nullptr;
+}
+
+int main(int argc, char **argv) {
+  std::filesystem::path resources = "resources";
+  int framesCount = 5;
+  int storageBits = 32;
+  float relaxation = 1.0f;
+  bool enableRayCones = false;
+  bool useRopes = false;
+  SDFGridLayout gridLayout = SDFGridLayout::Linear;
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+      framesCount = std::max(1, std::atoi(argv[++i]));
+    } else if (std::strcmp(argv[i], "--storage") == 0 && i + 1 < argc) {
+      storageBits = std::atoi(argv[++i]);
+    } else if (std::strcmp(argv[i], "--grid-layout") == 0 && i + 1 < argc) {
+      gridLayout = std::strcmp(argv[++i], "tiled") == 0 ? SDFGridLayout::Tiled
+                                                        : SDFGridLayout::Linear;
+    } else if (std::strcmp(argv[i], "--relaxation") == 0 && i + 1 < argc) {
+      relaxation = std::max(1.0f, std::strtof(argv[++i], nullptr));
+    } else if (std::strcmp(argv[i], "--ray-cones") == 0) {
+      enableRayCones = true;
+    } else if (std::strcmp(argv[i], "--ropes") == 0) {
+      useRopes = true;
+    } else {
+      resources = argv[i];
+    }
+  }
+
+  SDFStorage storage = SDFStorage::Float32;
+  if (storageBits == 16) {
+    storage = SDFStorage::Int16;
+  } else if (storageBits == 8) {
+    storage = SDFStorage::Int8;
+  } else {
+    storageBits = 32;
+  }
+
+  std::vector<std::filesystem::path> models;
+  for (auto &entry : std::filesystem::directory_iterator(resources)) {
+    auto extension = entry.path().extension();
+    if (extension == ".obj" || extension == ".grid" ||
+        extension == ".bricks" || extension == ".octree") {
+      models.push_back(entry.path());
+    }
+  }
+  std::sort(models.begin(), models.end());
+
+  Renderer renderer;
+  renderer.lightPos = {2, 2, 2};
+  renderer.enableRayCones = enableRayCones;
+  CacheMissCounter cacheMisses;
+  FrameBuffer frameBuffer;
+
+  std::cout << "{\n  \"frames\": " << framesCount
+            << ",\n  \"sdf_storage_bits\": " << storageBits
+            << ",\n  \"grid_layout\": \""
+            << (gridLayout == SDFGridLayout::Tiled ? "tiled" : "linear")
+            << "\""
+            << ",\n  \"relaxation\": " << relaxation
+            << ",\n  \"ray_cones\": " << (enableRayCones ? "true" : "false")
+            << ",\n  \"ropes\": " << (useRopes ? "true" : "false")
+            << ",\n  \"models\": [";
+  for (size_t modelID = 0; modelID < models.size(); ++modelID) {
+    auto &path = models[modelID];
+
+    // loaders report progress to stdout, keep it out of the JSON
+    auto pCoutBuf = std::cout.rdbuf(std::cerr.rdbuf());
+    BBox3f modelBox;
+    auto b = std::chrono::high_resolution_clock::now();
+    auto pScene = loadScene(path, storage, gridLayout, relaxation, useRopes,
+                            modelBox);
+    auto e = std::chrono::high_resolution_clock::now();
+    std::cout.rdbuf(pCoutBuf);
+    float loadTime = static_cast<float>(std::chrono::duration_cast<std::chrono::microseconds>(e-b).count())/1e3f;
+
+    auto pGroundPlane = std::make_shared<Plane>(float3{0.0f, 1.0f, 0.0f},
+                                                modelBox.boxMin.y);
+    SceneUnion fullScene(pScene, pGroundPlane);
+
+    std::cout << (modelID == 0 ? "" : ",") << "\n    {\n"
+              << "      \"file\": \"" << path.filename().string() << "\",\n"
+              << "      \"load_ms\": " << loadTime << ",\n"
+              << "      \"runs\": [";
+
+    auto pGrid = std::dynamic_pointer_cast<SDFGrid>(pScene);
+    auto pOctree = std::dynamic_pointer_cast<SDFOctree>(pScene);
+    std::span<const BenchGridConfig> gridConfigs(BENCH_GRID_CONFIGS, 1);
+    if (pGrid) {
+      gridConfigs = BENCH_GRID_CONFIGS;
+      pGrid->countSteps = true;
+    } else if (pOctree) {
+      pOctree->countSteps = true;
+    }
+
+    bool firstRun = true;
+    for (auto &resolution : BENCH_RESOLUTIONS) {
+      frameBuffer.resize(resolution.width, resolution.height);
+      auto proj = perspectiveMatrix(45.0f,
+                                    static_cast<float>(resolution.width) /
+                                        static_cast<float>(resolution.height),
+                                    0.01f, 100.0f);
+      auto projInv = inverse4x4(proj);
+      for (auto &mode : BENCH_MODES) {
+        renderer.shadingMode = mode.mode;
+        for (auto &benchCamera : BENCH_CAMERAS) {
+          for (auto &gridConfig : gridConfigs) {
+            Camera camera(benchCamera.position, float3{0.0f});
+            if (pGrid) {
+              pGrid->skipEmptySpace = gridConfig.skipEmptySpace;
+              pGrid->intersectionMode = gridConfig.intersection;
+              pGrid->resetMarchCounters();
+            } else if (pOctree) {
+              pOctree->resetMarchCounters();
+            }
+            std::vector<float> times;
+            // the first frame only warms up caches and the thread pool
+            for (int frame = 0; frame <= framesCount; ++frame) {
+              frameBuffer.clear();
+              if (frame == 1 && cacheMisses.available()) {
+                cacheMisses.start();
+              }
+              float time =
+                  renderer.draw(fullScene, frameBuffer, camera, projInv);
+              if (frame > 0) {
+                times.push_back(time);
+              }
+            }
+
+            uint64_t misses =
+                cacheMisses.available() ? cacheMisses.stop() : 0;
+
+            float median = percentile(times, 0.5f);
+            float primaryRays = static_cast<float>(resolution.width) *
+                                static_cast<float>(resolution.height);
+            std::cout << (firstRun ? "" : ",") << "\n        {"
+                      << "\"width\": " << resolution.width
+                      << ", \"height\": " << resolution.height
+                      << ", \"mode\": \"" << mode.name << "\""
+                      << ", \"camera\": \"" << benchCamera.name << "\"";
+            const MarchCounters *pCounters =
+                pGrid ? &pGrid->marchCounters()
+                      : (pOctree ? &pOctree->marchCounters() : nullptr);
+            if (pGrid) {
+              std::cout << ", \"grid_config\": \"" << gridConfig.name
+                        << "\"";
+            }
+            if (pCounters) {
+              // steps of all traced rays, shadows and reflections included
+              float steps = static_cast<float>(pCounters->steps()) /
+                            static_cast<float>(framesCount + 1);
+              std::cout << ", \"steps_per_pixel\": " << steps / primaryRays
+                        << ", \"steps_per_ray\": "
+                        << pCounters->stepsPerRay();
+            }
+            if (pOctree) {
+              std::cout << ", \"node_visits_per_ray\": "
+                        << pCounters->visitsPerRay();
+            }
+            if (cacheMisses.available()) {
+              std::cout << ", \"cache_misses_per_pixel\": "
+                        << static_cast<float>(misses) /
+                               static_cast<float>(framesCount) / primaryRays;
+            }
+            std::cout << ", \"min_ms\": " << percentile(times, 0.0f)
+                      << ", \"p50_ms\": " << median
+                      << ", \"p90_ms\": " << percentile(times, 0.9f)
+                      << ", \"p99_ms\": " << percentile(times, 0.99f)
+                      << ", \"primary_mrays_per_s\": "
+                      << primaryRays / (median * 1e3f) << "}";
+            firstRun = false;
+          }
+        }
+      }
+    }
+    std::cout << "\n      ]\n    }";
+  }
+  std::cout << "\n  ]\n}" << std::endl;
+  return 0;
+}
@@ -0,0 +1,368 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
+
+#include "brick_raytracing.hpp"
+
+using namespace LiteMath;
+
+constexpr uint32_t BRICK_VOLUME = BRICK_SAMPLES * BRICK_SAMPLES * BRICK_SAMPLES;
+constexpr float HIT_EPS = 1e-3f;
+// offset past the exit of a skipped coarse cell
+constexpr float SKIP_EPS = 1e-4f;
+
+uint32_t SDFBrickGrid::locate(LiteMath::float3 point, float corners[8],
+                              LiteMath::float3 &coords) const noexcept {
+  float3 cells = {static_cast<float>(size.x - 1),
+                  static_cast<float>(size.y - 1),
+                  static_cast<float>(size.z - 1)};
+  point = (point + 1.0f) / 2.0f * cells;
+
+  // the last cell also owns the far boundary samples
+  float3 c0f = clamp(floor(point), float3{0.0f}, cells - 1.0f);
+  coords = point - c0f;
+
+  uint3 c0 = {static_cast<uint32_t>(c0f.x), static_cast<uint32_t>(c0f.y),
+              static_cast<uint32_t>(c0f.z)};
+  uint3 brick = {c0.x / BRICK_SIZE, c0.y / BRICK_SIZE, c0.z / BRICK_SIZE};
+  uint32_t cell =
+      (brick.x * bricksCount.y + brick.y) * bricksCount.z + brick.z;
+
+  uint32_t brickIndex = brickIndices[cell];
+  if (brickIndex != EMPTY_BRICK) {
+    uint3 local = {c0.x - brick.x * BRICK_SIZE, c0.y - brick.y * BRICK_SIZE,
+                   c0.z - brick.z * BRICK_SIZE};
+    const float *base =
+        brickValues.data() + static_cast<size_t>(brickIndex) * BRICK_VOLUME;
+    auto at = [&](uint32_t x, uint32_t y, uint32_t z) {
+      return base[((local.x + x) * BRICK_SAMPLES + local.y + y) *
+                      BRICK_SAMPLES +
+                  local.z + z];
+    };
+    corners[0] = at(0, 0, 0);
+    corners[1] = at(0, 0, 1);
+    corners[2] = at(0, 1, 0);
+    corners[3] = at(0, 1, 1);
+    corners[4] = at(1, 0, 0);
+    corners[5] = at(1, 0, 1);
+    corners[6] = at(1, 1, 0);
+    corners[7] = at(1, 1, 1);
+  }
+  return cell;
+}
+
+float SDFBrickGrid::sdf(LiteMath::float3 point) const noexcept {
+  float corners[8];
+  float3 coords;
+  uint32_t cell = locate(point, corners, coords);
+  if (brickIndices[cell] == EMPTY_BRICK) {
+    return coarseValues[cell];
+  }
+  return trilinear(corners, coords);
+}
+
+SDFSample SDFBrickGrid::sample(LiteMath::float3 point) const noexcept {
+  float corners[8];
+  float3 coords;
+  uint32_t cell = locate(point, corners, coords);
+  if (brickIndices[cell] == EMPTY_BRICK) {
+    SDFSample result;
+    result.value = coarseValues[cell];
+    result.gradient = float3{0.0f};
+    return result;
+  }
+  auto result = trilinearWithGradient(corners, coords);
+  result.gradient *= float3{static_cast<float>(size.x - 1),
+                            static_cast<float>(size.y - 1),
+                            static_cast<float>(size.z - 1)} /
+                     2.0f;
+  return result;
+}
+
+float SDFBrickGrid::cellExit(uint32_t cell, const LiteMath::float3 &rayPos,
+                             const LiteMath::float3 &rayDir) const noexcept {
+  uint32_t slice = bricksCount.y * bricksCount.z;
+  float3 brick = {static_cast<float>(cell / slice),
+                  static_cast<float>(cell % slice / bricksCount.z),
+                  static_cast<float>(cell % bricksCount.z)};
+  float3 cells = {static_cast<float>(size.x - 1),
+                  static_cast<float>(size.y - 1),
+                  static_cast<float>(size.z - 1)};
+  float3 cellMin = brick * static_cast<float>(BRICK_SIZE);
+  float3 cellMax = min(cellMin + static_cast<float>(BRICK_SIZE), cells);
+  cellMin = cellMin / cells * 2.0f - 1.0f;
+  cellMax = cellMax / cells * 2.0f - 1.0f;
+
+  float tExit = std::numeric_limits<float>::infinity();
+  for (int axis = 0; axis < 3; ++axis) {
+    if (rayDir[axis] > 0.0f) {
+      tExit = std::min(tExit, (cellMax[axis] - rayPos[axis]) / rayDir[axis]);
+    } else if (rayDir[axis] < 0.0f) {
+      tExit = std::min(tExit, (cellMin[axis] - rayPos[axis]) / rayDir[axis]);
+    }
+  }
+  return tExit;
+}
+
+bool SDFBrickGrid::march(const LiteMath::float3 &rayPos,
+                         const LiteMath::float3 &rayDir, float tNear,
+                         float tFar, float &tHit,
+                         LiteMath::float3 &hitPoint) const {
+  auto boxIntersection = BBox3f{float3{-1.0f}, float3{1.0f}}.Intersection(
+      rayPos, 1.0f / rayDir, tNear, tFar);
+  if (boxIntersection.t1 > boxIntersection.t2) {
+    return false; // no hit
+  }
+
+  float t = boxIntersection.t1;
+  float3 curPoint = rayPos + t * rayDir;
+  curPoint = max(curPoint, float3{-1.0f});
+  curPoint = min(curPoint, float3{1.0f});
+
+  while (all_of(curPoint <= float3{1.0f}) &&
+         all_of(curPoint >= float3{-1.0f})) {
+    float corners[8];
+    float3 coords;
+    uint32_t cell = locate(curPoint, corners, coords);
+
+    float curSdf = 0.0f;
+    if (brickIndices[cell] == EMPTY_BRICK) {
+      if (coarseValues[cell] >= 0.0f) {
+        // no surface in the whole brick, the coarse value is the smallest
+        // distance in it and may reach past its exit
+        t = std::max({t, cellExit(cell, rayPos, rayDir),
+                      t + coarseValues[cell]}) +
+            SKIP_EPS;
+        curPoint = rayPos + t * rayDir;
+        continue;
+      }
+      curSdf = 0.0f; // the ray is inside the surface
+    } else {
+      curSdf = trilinear(corners, coords);
+    }
+
+    if (curSdf < HIT_EPS) {
+      tHit = t + curSdf;
+      hitPoint = curPoint;
+      return true;
+    }
+
+    t += curSdf;
+    curPoint = rayPos + t * rayDir;
+  }
+
+  return false;
+}
+
+HitInfo SDFBrickGrid::intersect(const LiteMath::float3 &rayPos,
+                                const LiteMath::float3 &rayDir, float tNear,
+                                float tFar) const {
+  HitInfo result;
+  float3 hitPoint;
+  if (march(rayPos, rayDir, tNear, tFar, result.t, hitPoint)) {
+    result.hitten = true;
+    float3 gradient = sample(hitPoint).gradient;
+    // the ray entered an empty brick inside the surface
+    result.normal = dot(gradient, gradient) > 0.0f ? normalize(gradient)
+                                                   : -rayDir;
+  }
+  return result;
+}
+
+void SDFBrickGrid::intersect(std::span<const Ray> rays,
+                             std::span<HitInfo> hits) const {
+  for (size_t i = 0; i < rays.size(); ++i) {
+    hits[i] = intersect(rays[i].pos, rays[i].dir, rays[i].tNear, rays[i].tFar);
+  }
+}
+
+bool SDFBrickGrid::occluded(const LiteMath::float3 &rayPos,
+                            const LiteMath::float3 &rayDir, float tNear,
+                            float tFar) const {
+  float t = 0.0f;
+  float3 hitPoint;
+  return march(rayPos, rayDir, tNear, tFar, t, hitPoint) && t <= tFar;
+}
+
+void convertSDFGrid(const SDFGrid &grid, SDFBrickGrid &scene,
+                    float bandWidth) {
+  scene.size = grid.size;
+  uint3 cells = {grid.size.x - 1, grid.size.y - 1, grid.size.z - 1};
+  scene.bricksCount = {(cells.x + BRICK_SIZE - 1) / BRICK_SIZE,
+                       (cells.y + BRICK_SIZE - 1) / BRICK_SIZE,
+                       (cells.z + BRICK_SIZE - 1) / BRICK_SIZE};
+  uint32_t coarseCount =
+      scene.bricksCount.x * scene.bricksCount.y * scene.bricksCount.z;
+  scene.brickIndices.assign(coarseCount, EMPTY_BRICK);
+  scene.coarseValues.assign(coarseCount, 0.0f);
+
+  // grid values are world space distances, a cell is 2/(size-1) wide
+  float band = bandWidth * 2.0f /
+               static_cast<float>(std::max({cells.x, cells.y, cells.z}));
+  auto sampleAt = [&](uint3 brick, uint32_t x, uint32_t y, uint32_t z) {
+    // bricks on the far boundary repeat the last samples
+    return grid.sdf(
+        uint3{std::min(brick.x * BRICK_SIZE + x, cells.x),
+              std::min(brick.y * BRICK_SIZE + y, cells.y),
+              std::min(brick.z * BRICK_SIZE + z, cells.z)});
+  };
+  auto brickCoords = [&](uint32_t cell) {
+    uint32_t slice = scene.bricksCount.y * scene.bricksCount.z;
+    return uint3{cell / slice, cell % slice / scene.bricksCount.z,
+                 cell % scene.bricksCount.z};
+  };
+
+  std::vector<uint8_t> keep(coarseCount);
+#pragma omp parallel for
+  for (int cell = 0; cell < static_cast<int>(coarseCount); ++cell) {
+    uint3 brick = brickCoords(static_cast<uint32_t>(cell));
+    float minValue = std::numeric_limits<float>::infinity();
+    float maxValue = -std::numeric_limits<float>::infinity();
+    for (uint32_t x = 0; x < BRICK_SAMPLES; ++x) {
+      for (uint32_t y = 0; y < BRICK_SAMPLES; ++y) {
+        for (uint32_t z = 0; z < BRICK_SAMPLES; ++z) {
+          float value = sampleAt(brick, x, y, z);
+          minValue = std::min(minValue, value);
+          maxValue = std::max(maxValue, value);
+        }
+      }
+    }
+    // samples of one sign further than the band from the surface
+    keep[static_cast<size_t>(cell)] = minValue <= band && maxValue >= -band;
+    scene.coarseValues[static_cast<size_t>(cell)] =
+        minValue > 0.0f ? minValue : maxValue;
+  }
+
+  uint32_t storedCount = 0;
+  for (uint32_t cell = 0; cell < coarseCount; ++cell) {
+    if (keep[cell]) {
+      scene.brickIndices[cell] = storedCount++;
+    }
+  }
+
+  scene.brickValues.resize(static_cast<size_t>(storedCount) * BRICK_VOLUME);
+#pragma omp parallel for
+  for (int cell = 0; cell < static_cast<int>(coarseCount); ++cell) {
+    uint32_t brickIndex = scene.brickIndices[static_cast<size_t>(cell)];
+    if (brickIndex == EMPTY_BRICK) {
+      continue;
+    }
+    uint3 brick = brickCoords(static_cast<uint32_t>(cell));
+    float *base =
+        scene.brickValues.data() + static_cast<size_t>(brickIndex) * BRICK_VOLUME;
+    for (uint32_t x = 0; x < BRICK_SAMPLES; ++x) {
+      for (uint32_t y = 0; y < BRICK_SAMPLES; ++y) {
+        for (uint32_t z = 0; z < BRICK_SAMPLES; ++z) {
+          base[(x * BRICK_SAMPLES + y) * BRICK_SAMPLES + z] =
+              sampleAt(brick, x, y, z);
+        }
+      }
+    }
+  }
+
+  float denseMB = static_cast<float>(static_cast<size_t>(grid.size.x) *
+                                    grid.size.y * grid.size.z * sizeof(float)) /
+                  (1024.0f * 1024.0f);
+  float sparseMB =
+      static_cast<float>(scene.brickValues.size() * sizeof(float) +
+                         coarseCount * (sizeof(uint32_t) + sizeof(float))) /
+      (1024.0f * 1024.0f);
+  std::cout << "Bricks: " << storedCount << "/" << coarseCount << " stored, "
+            << sparseMB << "MB instead of " << denseMB << "MB" << std::endl;
+}
+
+struct BrickGridHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t brickSize;
+  uint32_t storedBricks;
+  uint32_t size[3];
+  uint32_t bricksCount[3];
+};
+
+constexpr char BRICK_GRID_MAGIC[4] = {'S', 'D', 'F', 'B'};
+constexpr uint32_t BRICK_GRID_VERSION = 1;
+
+void saveSDFBrickGrid(const SDFBrickGrid &scene, const std::string &path) {
+  BrickGridHeader header = {};
+  std::memcpy(header.magic, BRICK_GRID_MAGIC, sizeof(header.magic));
+  header.version = BRICK_GRID_VERSION;
+  header.brickSize = BRICK_SIZE;
+  header.storedBricks = static_cast<uint32_t>(scene.storedBricks());
+  header.size[0] = scene.size.x;
+  header.size[1] = scene.size.y;
+  header.size[2] = scene.size.z;
+  header.bricksCount[0] = scene.bricksCount.x;
+  header.bricksCount[1] = scene.bricksCount.y;
+  header.bricksCount[2] = scene.bricksCount.z;
+
+  std::ofstream fs(path, std::ios::binary);
+  fs.write((const char *)&header, sizeof(header));
+  fs.write((const char *)scene.brickIndices.data(),
+           static_cast<std::streamsize>(scene.brickIndices.size() *
+                                        sizeof(uint32_t)));
+  fs.write((const char *)scene.coarseValues.data(),
+           static_cast<std::streamsize>(scene.coarseValues.size() *
+                                        sizeof(float)));
+  fs.write((const char *)scene.brickValues.data(),
+           static_cast<std::streamsize>(scene.brickValues.size() *
+                                        sizeof(float)));
+  if (!fs) {
+    throw std::runtime_error("Can not write " + path);
+  }
+}
+
+void loadSDFBrickGrid(SDFBrickGrid &scene, const std::string &path) {
+  std::ifstream fs(path, std::ios::binary);
+  BrickGridHeader header = {};
+  fs.read((char *)&header, sizeof(header));
+  if (!fs ||
+      std::memcmp(header.magic, BRICK_GRID_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != BRICK_GRID_VERSION || header.brickSize != BRICK_SIZE) {
+    throw std::runtime_error(path + " is not a brick grid");
+  }
+
+  // the brick index has to cover the cells of the grid exactly, which also
+  // bounds the sizes read below
+  uint64_t samplesCount = static_cast<uint64_t>(header.size[0]) *
+                          header.size[1] * header.size[2];
+  for (int axis = 0; axis < 3; ++axis) {
+    if (header.size[axis] < 2 || samplesCount > UINT32_MAX ||
+        header.bricksCount[axis] !=
+            (header.size[axis] - 1 + BRICK_SIZE - 1) / BRICK_SIZE) {
+      throw std::runtime_error(path + " has invalid brick grid sizes");
+    }
+  }
+  scene.size = {header.size[0], header.size[1], header.size[2]};
+  scene.bricksCount = {header.bricksCount[0], header.bricksCount[1],
+                       header.bricksCount[2]};
+  size_t coarseCount = static_cast<size_t>(scene.bricksCount.x) *
+                       scene.bricksCount.y * scene.bricksCount.z;
+  if (header.storedBricks > coarseCount) {
+    throw std::runtime_error(path + " has invalid brick grid sizes");
+  }
+  scene.brickIndices.resize(coarseCount);
+  scene.coarseValues.resize(coarseCount);
+  scene.brickValues.resize(static_cast<size_t>(header.storedBricks) *
+                           BRICK_VOLUME);
+  fs.read((char *)scene.brickIndices.data(),
+          static_cast<std::streamsize>(coarseCount * sizeof(uint32_t)));
+  fs.read((char *)scene.coarseValues.data(),
+          static_cast<std::streamsize>(coarseCount * sizeof(float)));
+  fs.read((char *)scene.brickValues.data(),
+          static_cast<std::streamsize>(scene.brickValues.size() *
+                                       sizeof(float)));
+  if (!fs) {
+    throw std::runtime_error(path + " is truncated");
+  }
+  if (std::any_of(scene.brickIndices.begin(), scene.brickIndices.end(),
+                  [&](uint32_t index) {
+                    return index != EMPTY_BRICK &&
+                           index >= header.storedBricks;
+                  })) {
+    throw std::runtime_error(path + " has invalid brick indices");
+  }
+}
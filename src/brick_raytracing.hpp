@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "LiteMath/LiteMath.h"
+
+#include "grid_raytracing.hpp"
+#include "raytracing.hpp"
+#include "trilinear.hpp"
+
+// cells per brick side, a brick stores (BRICK_SIZE+1)^3 samples so that
+// neighbouring bricks share their boundary samples
+constexpr uint32_t BRICK_SIZE = 8;
+constexpr uint32_t BRICK_SAMPLES = BRICK_SIZE + 1;
+constexpr uint32_t EMPTY_BRICK = ~0u;
+
+// Sparse SDF grid. Only bricks near the zero level set keep their samples,
+// the others are represented in the coarse index by a single distance.
+struct SDFBrickGrid final : IScene {
+  LiteMath::uint3 size;        // samples of the full resolution grid
+  LiteMath::uint3 bricksCount; // bricks per axis
+  // brick index of every coarse cell or EMPTY_BRICK
+  std::vector<uint32_t> brickIndices;
+  // smallest distance of an empty coarse cell, negative for cells inside
+  // the surface
+  std::vector<float> coarseValues;
+  std::vector<float> brickValues;
+
+  float sdf(LiteMath::float3 point) const noexcept;
+  // value and gradient in world space
+  SDFSample sample(LiteMath::float3 point) const noexcept;
+  HitInfo intersect(const LiteMath::float3 &rayPos,
+                    const LiteMath::float3 &rayDir, float tNear,
+                    float tFar) const override;
+  void intersect(std::span<const Ray> rays,
+                 std::span<HitInfo> hits) const override;
+  bool occluded(const LiteMath::float3 &rayPos, const LiteMath::float3 &rayDir,
+                float tNear, float tFar) const override;
+  size_t storedBricks() const noexcept {
+    return brickValues.size() / (BRICK_SAMPLES * BRICK_SAMPLES * BRICK_SAMPLES);
+  }
+
+private:
+  // returns the coarse cell of the point, corners are fetched only for
+  // stored bricks
+  uint32_t locate(LiteMath::float3 point, float corners[8],
+                  LiteMath::float3 &coords) const noexcept;
+  // distance along the ray to the exit of the coarse cell
+  float cellExit(uint32_t cell, const LiteMath::float3 &rayPos,
+                 const LiteMath::float3 &rayDir) const noexcept;
+  bool march(const LiteMath::float3 &rayPos, const LiteMath::float3 &rayDir,
+             float tNear, float tFar, float &tHit,
+             LiteMath::float3 &hitPoint) const;
+};
+
+// keeps the bricks having samples closer than bandWidth cells to the surface
+void convertSDFGrid(const SDFGrid &grid, SDFBrickGrid &scene,
+                    float bandWidth = 2.0f);
+void loadSDFBrickGrid(SDFBrickGrid &scene, const std::string &path);
+void saveSDFBrickGrid(const SDFBrickGrid &scene, const std::string &path);
@@ -1,104 +1,430 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <fstream>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
 
 #include "grid_raytracing.hpp"
+#include <ray_pack_ispc.h>
 
 using namespace LiteMath;
 
-float SDFGrid::sdf(LiteMath::float3 point) const noexcept {
+void SDFGrid::locate(LiteMath::float3 point, float corners[8],
+                     LiteMath::float3 &coords) const noexcept {
   point = (point + 1.0f) / 2.0f;
   point *=
       float3{static_cast<float>(size.x - 1), static_cast<float>(size.y - 1),
              static_cast<float>(size.z - 1)};
 
+  // the last cell also owns the far boundary samples
   float3 c0f = floor(point);
-  float3 c1f = ceil(point);
+  c0f = min(c0f, float3{static_cast<float>(size.x - 2),
+                        static_cast<float>(size.y - 2),
+                        static_cast<float>(size.z - 2)});
+  c0f = max(c0f, float3{0.0f});
+  coords = point - c0f;
 
   uint3 c0 = {static_cast<uint32_t>(c0f.x), static_cast<uint32_t>(c0f.y),
               static_cast<uint32_t>(c0f.z)};
+  uint3 c1 = {c0.x + 1, c0.y + 1, c0.z + 1};
+
+  corners[0] = sdf(uint3{c0.x, c0.y, c0.z});
+  corners[1] = sdf(uint3{c0.x, c0.y, c1.z});
+  corners[2] = sdf(uint3{c0.x, c1.y, c0.z});
+  corners[3] = sdf(uint3{c0.x, c1.y, c1.z});
+  corners[4] = sdf(uint3{c1.x, c0.y, c0.z});
+  corners[5] = sdf(uint3{c1.x, c0.y, c1.z});
+  corners[6] = sdf(uint3{c1.x, c1.y, c0.z});
+  corners[7] = sdf(uint3{c1.x, c1.y, c1.z});
+}
+
+LiteMath::float3 SDFGrid::cellScale() const noexcept {
+  return float3{static_cast<float>(size.x - 1), static_cast<float>(size.y - 1),
+                static_cast<float>(size.z - 1)} /
+         2.0f;
+}
+
+float SDFGrid::sdf(LiteMath::float3 point) const noexcept {
+  float corners[8];
+  float3 coords;
+  locate(point, corners, coords);
+  return trilinear(corners, coords);
+}
+
+SDFSample SDFGrid::sample(LiteMath::float3 point) const noexcept {
+  float corners[8];
+  float3 coords;
+  locate(point, corners, coords);
+  auto result = trilinearWithGradient(corners, coords);
+  result.gradient *= cellScale();
+  return result;
+}
+
+constexpr int SAMPLE_BATCH_SIZE = 64;
+
+void SDFGrid::sample(std::span<const LiteMath::float3> points,
+                     std::span<SDFSample> samples) const {
+  float corners[8 * SAMPLE_BATCH_SIZE];
+  float coordsX[SAMPLE_BATCH_SIZE], coordsY[SAMPLE_BATCH_SIZE],
+      coordsZ[SAMPLE_BATCH_SIZE];
+  float sampleValues[SAMPLE_BATCH_SIZE], gradX[SAMPLE_BATCH_SIZE],
+      gradY[SAMPLE_BATCH_SIZE], gradZ[SAMPLE_BATCH_SIZE];
+  float3 scale = cellScale();
+
+  for (size_t first = 0; first < points.size(); first += SAMPLE_BATCH_SIZE) {
+    int count = static_cast<int>(
+        std::min(points.size() - first, static_cast<size_t>(SAMPLE_BATCH_SIZE)));
+    for (int i = 0; i < count; ++i) {
+      float pointCorners[8];
+      float3 coords;
+      locate(points[first + static_cast<size_t>(i)], pointCorners, coords);
+      for (int c = 0; c < 8; ++c) {
+        corners[c * count + i] = pointCorners[c];
+      }
+      coordsX[i] = coords.x;
+      coordsY[i] = coords.y;
+      coordsZ[i] = coords.z;
+    }
+
+    ispc::trilinear_with_gradient(corners, coordsX, coordsY, coordsZ, count,
+                                  sampleValues, gradX, gradY, gradZ);
+
+    for (int i = 0; i < count; ++i) {
+      auto &result = samples[first + static_cast<size_t>(i)];
+      result.value = sampleValues[i];
+      result.gradient = float3{gradX[i], gradY[i], gradZ[i]} * scale;
+    }
+  }
+}
 
-  uint3 c1 = {static_cast<uint32_t>(c1f.x), static_cast<uint32_t>(c1f.y),
-              static_cast<uint32_t>(c1f.z)};
+LiteMath::float3 SDFGrid::normal(LiteMath::float3 point) const noexcept {
+  return normalize(sample(point).gradient);
+}
 
-  float3 p_c0f = point - c0f;
-  float3 c1f_p = c1f - point;
+constexpr float HIT_EPS = 1e-3f;
 
-  if (c1.x == c0.x) [[unlikely]] {
-    p_c0f.x = 1.0f;
-    c1f_p.x = 0.0f;
+// fine cells per block side on the finest pyramid level
+constexpr uint32_t PYRAMID_BASE_BLOCK = 4;
+// offset past the exit of a skipped block
+constexpr float SKIP_EPS = 1e-4f;
+
+void SDFGrid::buildPyramid() {
+  levels.clear();
+  if (size.x < 2 || size.y < 2 || size.z < 2) {
+    return;
   }
 
-  if (c1.y == c0.y) [[unlikely]] {
-    p_c0f.y = 1.0f;
-    c1f_p.y = 0.0f;
+  uint3 cells = {size.x - 1, size.y - 1, size.z - 1};
+  SDFGridLevel base;
+  base.blockSize = PYRAMID_BASE_BLOCK;
+  base.size = {(cells.x + PYRAMID_BASE_BLOCK - 1) / PYRAMID_BASE_BLOCK,
+               (cells.y + PYRAMID_BASE_BLOCK - 1) / PYRAMID_BASE_BLOCK,
+               (cells.z + PYRAMID_BASE_BLOCK - 1) / PYRAMID_BASE_BLOCK};
+  base.minValues.resize(base.size.x * base.size.y * base.size.z);
+#pragma omp parallel for
+  for (int x = 0; x < static_cast<int>(base.size.x); ++x) {
+    for (uint32_t y = 0; y < base.size.y; ++y) {
+      for (uint32_t z = 0; z < base.size.z; ++z) {
+        uint3 from = uint3{static_cast<uint32_t>(x), y, z} * PYRAMID_BASE_BLOCK;
+        uint3 to = {std::min(from.x + PYRAMID_BASE_BLOCK, cells.x),
+                    std::min(from.y + PYRAMID_BASE_BLOCK, cells.y),
+                    std::min(from.z + PYRAMID_BASE_BLOCK, cells.z)};
+        // the block covers its boundary samples too, trilinear values inside
+        // never go below the smallest corner
+        float minValue = std::numeric_limits<float>::infinity();
+        for (uint32_t i = from.x; i <= to.x; ++i) {
+          for (uint32_t j = from.y; j <= to.y; ++j) {
+            for (uint32_t k = from.z; k <= to.z; ++k) {
+              minValue = std::min(minValue, sdf(uint3{i, j, k}));
+            }
+          }
+        }
+        base.minValues[(static_cast<uint32_t>(x) * base.size.y + y) *
+                           base.size.z +
+                       z] = std::max(minValue, 0.0f);
+      }
+    }
   }
+  levels.push_back(std::move(base));
 
-  if (c1.z == c0.z) [[unlikely]] {
-    p_c0f.z = 1.0f;
-    c1f_p.z = 0.0f;
+  while (levels.back().size.x > 1 || levels.back().size.y > 1 ||
+         levels.back().size.z > 1) {
+    const auto &prev = levels.back();
+    SDFGridLevel level;
+    level.blockSize = prev.blockSize * 2;
+    level.size = {(prev.size.x + 1) / 2, (prev.size.y + 1) / 2,
+                  (prev.size.z + 1) / 2};
+    level.minValues.resize(level.size.x * level.size.y * level.size.z);
+    for (uint32_t x = 0; x < level.size.x; ++x) {
+      for (uint32_t y = 0; y < level.size.y; ++y) {
+        for (uint32_t z = 0; z < level.size.z; ++z) {
+          float minValue = std::numeric_limits<float>::infinity();
+          for (uint32_t i = 2 * x; i < std::min(2 * x + 2, prev.size.x); ++i) {
+            for (uint32_t j = 2 * y; j < std::min(2 * y + 2, prev.size.y);
+                 ++j) {
+              for (uint32_t k = 2 * z; k < std::min(2 * z + 2, prev.size.z);
+                   ++k) {
+                minValue = std::min(
+                    minValue,
+                    prev.minValues[(i * prev.size.y + j) * prev.size.z + k]);
+              }
+            }
+          }
+          level.minValues[(x * level.size.y + y) * level.size.z + z] =
+              minValue;
+        }
+      }
+    }
+    levels.push_back(std::move(level));
   }
+}
+
+float SDFGrid::emptyBlockExit(const LiteMath::float3 &point,
+                              const LiteMath::float3 &rayPos,
+                              const LiteMath::float3 &rayDir,
+                              float &minValue) const noexcept {
+  float3 cells = {static_cast<float>(size.x - 1),
+                  static_cast<float>(size.y - 1),
+                  static_cast<float>(size.z - 1)};
+  float3 gridPoint = (point + 1.0f) / 2.0f * cells;
+
+  // a block of a coarser level is empty only if all of its children are,
+  // so walk up from the finest level while the blocks stay empty
+  float tExit = -1.0f;
+  minValue = 0.0f;
+  for (auto &level : levels) {
+    auto blockSize = static_cast<float>(level.blockSize);
+    uint3 block = {
+        std::min(static_cast<uint32_t>(gridPoint.x / blockSize),
+                 level.size.x - 1),
+        std::min(static_cast<uint32_t>(gridPoint.y / blockSize),
+                 level.size.y - 1),
+        std::min(static_cast<uint32_t>(gridPoint.z / blockSize),
+                 level.size.z - 1)};
+    float levelMin =
+        level.minValues[(block.x * level.size.y + block.y) * level.size.z +
+                        block.z];
+    if (levelMin <= HIT_EPS) {
+      break;
+    }
+    // coarser blocks only have smaller bounds
+    if (tExit < 0.0f) {
+      minValue = levelMin;
+    }
 
-  float p[8] = {};
-  p[0] = sdf(uint3{c0.x, c0.y, c0.z});
-  p[1] = sdf(uint3{c0.x, c0.y, c1.z});
-  p[2] = sdf(uint3{c0.x, c1.y, c0.z});
-  p[3] = sdf(uint3{c0.x, c1.y, c1.z});
-  p[4] = sdf(uint3{c1.x, c0.y, c0.z});
-  p[5] = sdf(uint3{c1.x, c0.y, c1.z});
-  p[6] = sdf(uint3{c1.x, c1.y, c0.z});
-  p[7] = sdf(uint3{c1.x, c1.y, c1.z});
+    float3 blockMin = float3{static_cast<float>(block.x),
+                             static_cast<float>(block.y),
+                             static_cast<float>(block.z)} *
+                      blockSize;
+    float3 blockMax = min(blockMin + blockSize, cells);
+    blockMin = blockMin / cells * 2.0f - 1.0f;
+    blockMax = blockMax / cells * 2.0f - 1.0f;
 
-  float res = 0.0f;
-  res += p[0] * c1f_p.x * c1f_p.y * c1f_p.z;
-  res += p[1] * c1f_p.x * c1f_p.y * p_c0f.z;
-  res += p[2] * c1f_p.x * p_c0f.y * c1f_p.z;
-  res += p[3] * c1f_p.x * p_c0f.y * p_c0f.z;
+    tExit = std::numeric_limits<float>::infinity();
+    for (int axis = 0; axis < 3; ++axis) {
+      if (rayDir[axis] > 0.0f) {
+        tExit = std::min(tExit, (blockMax[axis] - rayPos[axis]) / rayDir[axis]);
+      } else if (rayDir[axis] < 0.0f) {
+        tExit = std::min(tExit, (blockMin[axis] - rayPos[axis]) / rayDir[axis]);
+      }
+    }
+  }
+  return tExit;
+}
 
-  res += p[4] * p_c0f.x * c1f_p.y * c1f_p.z;
-  res += p[5] * p_c0f.x * c1f_p.y * p_c0f.z;
-  res += p[6] * p_c0f.x * p_c0f.y * c1f_p.z;
-  res += p[7] * p_c0f.x * p_c0f.y * p_c0f.z;
+// product of linear polynomials a0 + a1*s
+static void multiplyLinear(const float poly[4], float a0, float a1,
+                           float result[4]) noexcept {
+  result[0] = poly[0] * a0;
+  result[1] = poly[1] * a0 + poly[0] * a1;
+  result[2] = poly[2] * a0 + poly[1] * a1;
+  result[3] = poly[3] * a0 + poly[2] * a1;
+}
 
-  return res;
+static float evalCubic(const float c[4], float s) noexcept {
+  return ((c[3] * s + c[2]) * s + c[1]) * s + c[0];
 }
 
-constexpr float NORMAL_EPS = 1e-3f;
-LiteMath::float3 SDFGrid::normal(LiteMath::float3 point) const noexcept {
-  float xLeft =
-      (point.x - NORMAL_EPS >= -1.0f) ? point.x - NORMAL_EPS : point.x;
-  float xRight =
-      (point.x + NORMAL_EPS <= 1.0f) ? point.x + NORMAL_EPS : point.x;
-  float yLeft =
-      (point.y - NORMAL_EPS >= -1.0f) ? point.y - NORMAL_EPS : point.y;
-  float yRight =
-      (point.y + NORMAL_EPS <= 1.0f) ? point.y + NORMAL_EPS : point.y;
-  float zLeft =
-      (point.z - NORMAL_EPS >= -1.0f) ? point.z - NORMAL_EPS : point.z;
-  float zRight =
-      (point.z + NORMAL_EPS <= 1.0f) ? point.z + NORMAL_EPS : point.z;
+constexpr int ROOT_ITERATIONS = 16;
 
-  float dx = (sdf(float3{xRight, point.y, point.z}) -
-              sdf(float3{xLeft, point.y, point.z}));
+// returns the first root of the trilinear interpolant along the segment
+// cellPos + s*cellDir, s in [0, length], given in the cell local coords
+static bool solveCell(const float corners[8], const float3 &cellPos,
+                      const float3 &cellDir, float length,
+                      float &root) noexcept {
+  // f(s) = sum of corners weighted by products of per-axis linear weights
+  float cubic[4] = {};
+  for (int corner = 0; corner < 8; ++corner) {
+    int x = (corner >> 2) & 1;
+    int y = (corner >> 1) & 1;
+    int z = corner & 1;
+    float term[4] = {corners[corner], 0.0f, 0.0f, 0.0f};
+    float tmp[4];
+    multiplyLinear(term, x ? cellPos.x : 1.0f - cellPos.x,
+                   x ? cellDir.x : -cellDir.x, tmp);
+    multiplyLinear(tmp, y ? cellPos.y : 1.0f - cellPos.y,
+                   y ? cellDir.y : -cellDir.y, term);
+    multiplyLinear(term, z ? cellPos.z : 1.0f - cellPos.z,
+                   z ? cellDir.z : -cellDir.z, tmp);
+    for (int i = 0; i < 4; ++i) {
+      cubic[i] += tmp[i];
+    }
+  }
 
-  float dy = (sdf(float3{point.x, yRight, point.z}) -
-              sdf(float3{point.x, yLeft, point.z}));
+  if (cubic[0] <= 0.0f) {
+    root = 0.0f; // the cell is entered inside the surface
+    return true;
+  }
 
-  float dz = (sdf(float3{point.x, point.y, zRight}) -
-              sdf(float3{point.x, point.y, zLeft}));
+  // split the segment at the extrema, f is monotonic between them
+  float bounds[4] = {0.0f, length, length, length};
+  int boundsCount = 1;
+  float a = 3.0f * cubic[3];
+  float b = 2.0f * cubic[2];
+  float c = cubic[1];
+  if (std::abs(a) > 1e-12f) {
+    float discriminant = b * b - 4.0f * a * c;
+    if (discriminant >= 0.0f) {
+      float sq = std::sqrt(discriminant);
+      float r1 = (-b - sq) / (2.0f * a);
+      float r2 = (-b + sq) / (2.0f * a);
+      for (float r : {std::min(r1, r2), std::max(r1, r2)}) {
+        if (r > 0.0f && r < length) {
+          bounds[boundsCount++] = r;
+        }
+      }
+    }
+  } else if (std::abs(b) > 1e-12f) {
+    float r = -c / b;
+    if (r > 0.0f && r < length) {
+      bounds[boundsCount++] = r;
+    }
+  }
+  bounds[boundsCount++] = length;
 
-  return normalize(float3{dx, dy, dz});
+  for (int i = 0; i + 1 < boundsCount; ++i) {
+    float lo = bounds[i];
+    float hi = bounds[i + 1];
+    if (evalCubic(cubic, hi) > 0.0f) {
+      continue;
+    }
+    // safeguarded Newton, falls back to bisection outside of [lo, hi]
+    float s = 0.5f * (lo + hi);
+    for (int iteration = 0; iteration < ROOT_ITERATIONS; ++iteration) {
+      float value = evalCubic(cubic, s);
+      if (value > 0.0f) {
+        lo = s;
+      } else {
+        hi = s;
+      }
+      float derivative = (a * s + b) * s + c;
+      float next = derivative != 0.0f ? s - value / derivative : lo - 1.0f;
+      s = (next > lo && next < hi) ? next : 0.5f * (lo + hi);
+      if (hi - lo < 1e-6f) {
+        break;
+      }
+    }
+    root = hi;
+    return true;
+  }
+  return false;
 }
 
-constexpr float HIT_EPS = 1e-3f;
+// shift used to pick the cell behind a crossed cell boundary, in cells
+constexpr float CELL_EPS = 1e-4f;
 
-HitInfo SDFGrid::intersect(const LiteMath::float3 &rayPos,
-                           const LiteMath::float3 &rayDir, float tNear,
-                           float tFar) const {
-  HitInfo result;
+bool SDFGrid::marchCells(const LiteMath::float3 &rayPos,
+                         const LiteMath::float3 &rayDir, float tNear,
+                         float tFar, float &tHit,
+                         LiteMath::float3 &hitPoint) const {
+  auto boxIntersection = BBox3f{float3{-1.0f}, float3{1.0f}}.Intersection(
+      rayPos, 1.0f / rayDir, tNear, tFar);
+  if (boxIntersection.t1 > boxIntersection.t2) {
+    return false; // no hit
+  }
+
+  // grid coordinates are linear in t as well
+  float3 scale = cellScale();
+  float3 gridPos = (rayPos + 1.0f) * scale;
+  float3 gridDir = rayDir * scale;
+  float3 cells = scale * 2.0f;
+  float tShift = CELL_EPS / std::max({std::abs(gridDir.x), std::abs(gridDir.y),
+                                      std::abs(gridDir.z)});
+
+  bool hit = false;
+  uint64_t steps = 0;
+  bool useLevels = skipEmptySpace && !levels.empty();
+  float t = boxIntersection.t1;
+  while (t <= boxIntersection.t2) {
+    ++steps;
+    if (useLevels) {
+      float minValue = 0.0f;
+      float tExit = emptyBlockExit(
+          clamp(rayPos + t * rayDir, float3{-1.0f}, float3{1.0f}), rayPos,
+          rayDir, minValue);
+      if (tExit >= 0.0f) {
+        t = std::max(t, tExit) + SKIP_EPS;
+        continue;
+      }
+    }
+
+    // the cell is picked slightly ahead of t to step over its entry boundary
+    float3 cellPoint = gridPos + (t + tShift) * gridDir;
+    float3 cellMin = clamp(floor(cellPoint), float3{0.0f}, cells - 1.0f);
+    float tOut = boxIntersection.t2;
+    for (int axis = 0; axis < 3; ++axis) {
+      if (gridDir[axis] > 0.0f) {
+        tOut = std::min(tOut, (cellMin[axis] + 1.0f - gridPos[axis]) /
+                                  gridDir[axis]);
+      } else if (gridDir[axis] < 0.0f) {
+        tOut = std::min(tOut, (cellMin[axis] - gridPos[axis]) / gridDir[axis]);
+      }
+    }
+
+    uint3 c0 = {static_cast<uint32_t>(cellMin.x),
+                static_cast<uint32_t>(cellMin.y),
+                static_cast<uint32_t>(cellMin.z)};
+    float corners[8] = {
+        sdf(uint3{c0.x, c0.y, c0.z}),         sdf(uint3{c0.x, c0.y, c0.z + 1}),
+        sdf(uint3{c0.x, c0.y + 1, c0.z}),     sdf(uint3{c0.x, c0.y + 1, c0.z + 1}),
+        sdf(uint3{c0.x + 1, c0.y, c0.z}),     sdf(uint3{c0.x + 1, c0.y, c0.z + 1}),
+        sdf(uint3{c0.x + 1, c0.y + 1, c0.z}), sdf(uint3{c0.x + 1, c0.y + 1, c0.z + 1})};
+
+    // trilinear values stay within the corner range
+    if (*std::min_element(corners, corners + 8) <= 0.0f) {
+      float root = 0.0f;
+      float3 cellPos = gridPos + t * gridDir - cellMin;
+      if (solveCell(corners, cellPos, gridDir, std::max(tOut - t, 0.0f),
+                    root)) {
+        tHit = t + root;
+        hitPoint = rayPos + tHit * rayDir;
+        hit = true;
+        break;
+      }
+    }
+
+    t = std::max(tOut, t + tShift);
+  }
+
+  if (countSteps) {
+    m_marchCounters.add(steps, 1);
+  }
+  return hit;
+}
+
+bool SDFGrid::march(const LiteMath::float3 &rayPos,
+                    const LiteMath::float3 &rayDir, float tNear, float tFar,
+                    float &tHit, LiteMath::float3 &hitPoint) const {
+  if (intersectionMode == SDFGridIntersection::ExactCells) {
+    return marchCells(rayPos, rayDir, tNear, tFar, tHit, hitPoint);
+  }
 
   auto boxIntersection = BBox3f{float3{-1.0f}, float3{1.0f}}.Intersection(
       rayPos, 1.0f / rayDir, tNear, tFar);
   if (boxIntersection.t1 > boxIntersection.t2) {
-    return result; // no hit
+    return false; // no hit
   }
 
   float t = boxIntersection.t1;
@@ -106,29 +432,463 @@ HitInfo SDFGrid::intersect(const LiteMath::float3 &rayPos,
   curPoint = max(curPoint, float3{-1.0f});
   curPoint = min(curPoint, float3{1.0f});
 
-  while (all_of(curPoint <= float3{1.0f}) &&
-         all_of(curPoint >= float3{-1.0f})) {
+  bool hit = false;
+  uint64_t steps = 0;
+  bool useLevels = skipEmptySpace && !levels.empty();
+  SphereStepper stepper(marchPolicy, relaxation, t);
+  while (true) {
+    if (!all_of(curPoint <= float3{1.0f}) ||
+        !all_of(curPoint >= float3{-1.0f})) {
+      // an over-relaxed step may have left the grid past the surface
+      if (stepper.verify(t, 0.0f)) {
+        break;
+      }
+      curPoint = rayPos + t * rayDir;
+      continue;
+    }
+
+    ++steps;
+    if (useLevels) {
+      float minValue = 0.0f;
+      float tExit = emptyBlockExit(curPoint, rayPos, rayDir, minValue);
+      if (tExit >= 0.0f) {
+        if (stepper.verify(t, minValue)) {
+          t = std::max(t, tExit) + SKIP_EPS;
+          stepper.restart(t);
+        }
+        curPoint = rayPos + t * rayDir;
+        continue;
+      }
+    }
+
     float curSdf = sdf(curPoint);
+    if (!stepper.verify(t, curSdf)) {
+      curPoint = rayPos + t * rayDir;
+      continue;
+    }
 
     if (curSdf < HIT_EPS) {
-      result.hitten = true;
-      result.t = t + curSdf;
-      result.normal = normal(curPoint);
+      tHit = t + curSdf;
+      hitPoint = curPoint;
+      hit = true;
       break;
     }
 
-    t += curSdf;
+    t = stepper.advance(t, curSdf);
     curPoint = rayPos + t * rayDir;
   }
 
+  if (countSteps) {
+    m_marchCounters.add(steps, 1);
+  }
+  return hit;
+}
+
+HitInfo SDFGrid::intersect(const LiteMath::float3 &rayPos,
+                           const LiteMath::float3 &rayDir, float tNear,
+                           float tFar) const {
+  HitInfo result;
+  float3 hitPoint;
+  if (march(rayPos, rayDir, tNear, tFar, result.t, hitPoint)) {
+    result.hitten = true;
+    result.normal = normal(hitPoint);
+  }
   return result;
 }
 
+void SDFGrid::intersect(std::span<const Ray> rays,
+                        std::span<HitInfo> hits) const {
+  if (packetTracing &&
+      intersectionMode == SDFGridIntersection::SphereTracing) {
+    intersectPackets(rays, hits);
+    return;
+  }
+
+  std::vector<float3> hitPoints;
+  std::vector<size_t> hitIndices;
+  for (size_t i = 0; i < rays.size(); ++i) {
+    hits[i] = HitInfo{};
+    float3 hitPoint;
+    if (march(rays[i].pos, rays[i].dir, rays[i].tNear, rays[i].tFar,
+              hits[i].t, hitPoint)) {
+      hits[i].hitten = true;
+      hitPoints.push_back(hitPoint);
+      hitIndices.push_back(i);
+    }
+  }
+
+  // normals of all hits are evaluated in one batch
+  std::vector<SDFSample> samples(hitPoints.size());
+  sample(hitPoints, samples);
+  for (size_t i = 0; i < hitIndices.size(); ++i) {
+    hits[hitIndices[i]].normal = normalize(samples[i].gradient);
+  }
+}
+
+constexpr size_t PACKET_SIZE = 8;
+
+void SDFGrid::intersectPackets(std::span<const Ray> rays,
+                               std::span<HitInfo> hits) const {
+  ispc::SDFGridView view = {};
+  view.values = values.data();
+  view.values16 = quantized.values16.empty() ? nullptr
+                                             : quantized.values16.data();
+  view.values8 = quantized.values8.empty() ? nullptr : quantized.values8.data();
+  view.scale = quantized.scale;
+  view.tiled = m_layout == SDFGridLayout::Tiled ? 1 : 0;
+  view.tiles[0] = m_tiles.x;
+  view.tiles[1] = m_tiles.y;
+  view.tiles[2] = m_tiles.z;
+  view.size[0] = size.x;
+  view.size[1] = size.y;
+  view.size[2] = size.z;
+  // the kernel only skips blocks of the finest level
+  if (skipEmptySpace && !levels.empty()) {
+    view.minValues = levels.front().minValues.data();
+    view.blockSize = levels.front().blockSize;
+    view.levelSize[0] = levels.front().size.x;
+    view.levelSize[1] = levels.front().size.y;
+    view.levelSize[2] = levels.front().size.z;
+  }
+
+  for (size_t first = 0; first < rays.size(); first += PACKET_SIZE) {
+    size_t count = std::min(rays.size() - first, PACKET_SIZE);
+    ispc::Ray8 packet = {};
+    float tNear[PACKET_SIZE] = {};
+    float tFar[PACKET_SIZE] = {};
+    uint32_t activeMask = 0;
+    for (size_t i = 0; i < count; ++i) {
+      auto &ray = rays[first + i];
+      packet.orig_x[i] = ray.pos.x;
+      packet.orig_y[i] = ray.pos.y;
+      packet.orig_z[i] = ray.pos.z;
+      packet.dir_x[i] = ray.dir.x;
+      packet.dir_y[i] = ray.dir.y;
+      packet.dir_z[i] = ray.dir.z;
+      tNear[i] = ray.tNear;
+      tFar[i] = ray.tFar;
+      activeMask |= 1u << i;
+    }
+
+    ispc::HitInfo8 packetHits;
+    uint32_t steps = ispc::sphere_trace_grid_8(
+        &view, &packet, activeMask, tNear, tFar, HIT_EPS, SKIP_EPS,
+        marchPolicy == MarchPolicy::OverRelaxed ? relaxation : 1.0f,
+        &packetHits);
+    if (countSteps) {
+      m_marchCounters.add(steps, count);
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+      auto &hit = hits[first + i];
+      hit = HitInfo{};
+      if (packetHits.hitten[i] != 0) {
+        hit.hitten = true;
+        hit.t = packetHits.t[i];
+        hit.normal = float3{packetHits.norm_x[i], packetHits.norm_y[i],
+                            packetHits.norm_z[i]};
+      }
+    }
+  }
+}
+
+bool SDFGrid::occluded(const LiteMath::float3 &rayPos,
+                       const LiteMath::float3 &rayDir, float tNear,
+                       float tFar) const {
+  float t = 0.0f;
+  float3 hitPoint;
+  return march(rayPos, rayDir, tNear, tFar, t, hitPoint) && t <= tFar;
+}
+
+// 8 bit distances are truncated to a few cells to keep the precision
+constexpr float INT8_TRUNCATION_CELLS = 8.0f;
+
+void SDFGrid::quantize(SDFStorage storage) {
+  if (storage == SDFStorage::Float32 || values.empty()) {
+    return;
+  }
+
+  float maxValue = 0.0f;
+  for (float value : values) {
+    maxValue = std::max(maxValue, std::abs(value));
+  }
+  float cellSize = 2.0f / static_cast<float>(std::max(
+                              {size.x - 1, size.y - 1, size.z - 1}));
+  float truncation = maxValue;
+  if (storage == SDFStorage::Int8) {
+    truncation = std::min(truncation, INT8_TRUNCATION_CELLS * cellSize);
+  }
+
+  auto error = quantizeSDF(values, storage, truncation, quantized);
+  float floatMB = static_cast<float>(values.size() * sizeof(float)) /
+                  (1024.0f * 1024.0f);
+  float quantizedMB = static_cast<float>(quantized.bytes()) /
+                      (1024.0f * 1024.0f);
+  std::cout << "SDF grid quantized to "
+            << (storage == SDFStorage::Int16 ? 16 : 8) << " bit: "
+            << quantizedMB << "MB instead of " << floatMB
+            << "MB, max error " << error.maxError / cellSize
+            << " cells, mean error " << error.meanError / cellSize
+            << " cells" << std::endl;
+
+  values = {};
+  m_values = {};
+  m_file.close();
+}
+
+void SDFGrid::setValues(LiteMath::uint3 gridSize,
+                        std::vector<float> gridValues) {
+  size = gridSize;
+  m_file.close();
+  m_values = std::move(gridValues);
+  values = m_values;
+  quantized = {};
+  m_layout = SDFGridLayout::Linear;
+}
+
+constexpr uint32_t TILE_SIZE = 4;
+
+void SDFGrid::setLayout(SDFGridLayout layout) {
+  // quantized values are not reordered, the layout has to be set before
+  if (layout != m_layout && quantized.storage != SDFStorage::Float32) {
+    throw std::logic_error("SDF grid layout can not change after quantize");
+  }
+  if (layout == m_layout || values.empty()) {
+    return;
+  }
+
+  // tiled grids are padded to whole tiles
+  uint3 tiles = {(size.x + TILE_SIZE - 1) / TILE_SIZE,
+                 (size.y + TILE_SIZE - 1) / TILE_SIZE,
+                 (size.z + TILE_SIZE - 1) / TILE_SIZE};
+  uint3 extent = layout == SDFGridLayout::Tiled ? tiles * TILE_SIZE : size;
+  std::vector<float> reordered(static_cast<size_t>(extent.x) * extent.y *
+                               extent.z);
+#pragma omp parallel for
+  for (int x = 0; x < static_cast<int>(extent.x); ++x) {
+    for (uint32_t y = 0; y < extent.y; ++y) {
+      for (uint32_t z = 0; z < extent.z; ++z) {
+        uint3 coords = {static_cast<uint32_t>(x), y, z};
+        size_t index = layout == SDFGridLayout::Tiled
+                           ? tiledIndex(coords, tiles)
+                           : (coords.x * size.y + y) * size.z + z;
+        // the padding repeats the boundary samples
+        reordered[index] =
+            values[valueIndex(uint3{std::min(coords.x, size.x - 1),
+                                    std::min(y, size.y - 1),
+                                    std::min(z, size.z - 1)})];
+      }
+    }
+  }
+
+  m_file.close();
+  m_values = std::move(reordered);
+  values = m_values;
+  m_layout = layout;
+  m_tiles = tiles;
+}
+
+// .grid v2 layout: header, values, pyramid level headers and their minimal
+// values, each section aligned to GRID_ALIGNMENT
+struct GridHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t size[3];
+  uint32_t levelsCount;
+  uint64_t valuesOffset;
+  uint64_t levelsOffset;
+};
+
+struct GridLevelHeader {
+  uint32_t blockSize;
+  uint32_t size[3];
+  uint64_t valuesOffset;
+};
+
+constexpr char GRID_MAGIC[4] = {'S', 'D', 'F', 'G'};
+constexpr uint32_t GRID_VERSION = 2;
+constexpr uint64_t GRID_ALIGNMENT = 64;
+// legacy files are three sizes followed by the values
+constexpr uint64_t LEGACY_GRID_HEADER_SIZE = 3 * sizeof(uint32_t);
+
+static uint64_t alignGridOffset(uint64_t offset) {
+  return (offset + GRID_ALIGNMENT - 1) / GRID_ALIGNMENT * GRID_ALIGNMENT;
+}
+
+static uint64_t gridValuesCount(const uint32_t size[3]) {
+  return static_cast<uint64_t>(size[0]) * size[1] * size[2];
+}
+
+// sizes are small enough for the 32 bit indices used by the kernels
+static bool validGridSize(const uint32_t size[3]) {
+  return size[0] >= 2 && size[1] >= 2 && size[2] >= 2 &&
+         gridValuesCount(size) <= UINT32_MAX;
+}
+
 void loadSDFGrid(SDFGrid &scene, const std::string &path) {
-  std::ifstream fs(path, std::ios::binary);
-  fs.read((char *)&scene.size, 3 * sizeof(unsigned));
-  scene.values.resize(scene.size.x * scene.size.y * scene.size.z);
-  fs.read((char *)scene.values.data(),
-          scene.size.x * scene.size.y * scene.size.z * sizeof(float));
+  MappedFile file(path);
+  auto fail = [&path](const std::string &reason) {
+    throw std::runtime_error("Malformed grid " + path + ": " + reason);
+  };
+  // written without offset + bytes, which can wrap around
+  auto fitsFile = [&file](uint64_t offset, uint64_t bytes) {
+    return offset <= file.size() && bytes <= file.size() - offset;
+  };
+
+  GridHeader header = {};
+  bool isV2 = file.size() >= sizeof(header) &&
+              std::memcmp(file.data(), GRID_MAGIC, sizeof(GRID_MAGIC)) == 0;
+  if (!isV2) {
+    uint32_t size[3] = {};
+    if (file.size() < LEGACY_GRID_HEADER_SIZE) {
+      fail("file is too short");
+    }
+    std::memcpy(size, file.data(), sizeof(size));
+    if (!validGridSize(size)) {
+      fail("invalid size");
+    }
+    if (file.size() !=
+        LEGACY_GRID_HEADER_SIZE + gridValuesCount(size) * sizeof(float)) {
+      fail("file size does not match the grid size");
+    }
+    scene.size = {size[0], size[1], size[2]};
+    scene.values = {reinterpret_cast<const float *>(file.data() +
+                                                    LEGACY_GRID_HEADER_SIZE),
+                    gridValuesCount(size)};
+    scene.m_values = {};
+    scene.quantized = {};
+    scene.m_layout = SDFGridLayout::Linear;
+    scene.m_file = std::move(file);
+    // legacy files have no pyramid, this reads every page
+    scene.buildPyramid();
+    return;
+  }
+
+  std::memcpy(&header, file.data(), sizeof(header));
+  if (header.version != GRID_VERSION) {
+    fail("unsupported version " + std::to_string(header.version));
+  }
+  if (!validGridSize(header.size)) {
+    fail("invalid size");
+  }
+  uint64_t valuesCount = gridValuesCount(header.size);
+  if (header.valuesOffset % alignof(float) != 0 ||
+      header.valuesOffset < sizeof(header) ||
+      !fitsFile(header.valuesOffset, valuesCount * sizeof(float))) {
+    fail("values are out of the file");
+  }
+  if (header.levelsOffset % alignof(GridLevelHeader) != 0 ||
+      !fitsFile(header.levelsOffset,
+                static_cast<uint64_t>(header.levelsCount) *
+                    sizeof(GridLevelHeader))) {
+    fail("pyramid is out of the file");
+  }
+
+  std::vector<SDFGridLevel> levels(header.levelsCount);
+  for (uint32_t levelID = 0; levelID < header.levelsCount; ++levelID) {
+    GridLevelHeader levelHeader;
+    std::memcpy(&levelHeader,
+                file.data() + header.levelsOffset +
+                    levelID * sizeof(GridLevelHeader),
+                sizeof(levelHeader));
+    uint64_t levelCount = gridValuesCount(levelHeader.size);
+    auto blocksCount = [&](int axis) {
+      return (header.size[axis] - 2) / std::max(levelHeader.blockSize, 1u) + 1;
+    };
+    if (levelHeader.blockSize == 0 || levelHeader.size[0] != blocksCount(0) ||
+        levelHeader.size[1] != blocksCount(1) ||
+        levelHeader.size[2] != blocksCount(2) ||
+        levelHeader.valuesOffset % alignof(float) != 0 ||
+        !fitsFile(levelHeader.valuesOffset, levelCount * sizeof(float))) {
+      fail("invalid pyramid level");
+    }
+    auto &level = levels[levelID];
+    level.blockSize = levelHeader.blockSize;
+    level.size = {levelHeader.size[0], levelHeader.size[1],
+                  levelHeader.size[2]};
+    level.minValues.resize(levelCount);
+    std::memcpy(level.minValues.data(),
+                file.data() + levelHeader.valuesOffset,
+                levelCount * sizeof(float));
+  }
+
+  scene.size = {header.size[0], header.size[1], header.size[2]};
+  scene.values = {
+      reinterpret_cast<const float *>(file.data() + header.valuesOffset),
+      valuesCount};
+  scene.m_values = {};
+  scene.quantized = {};
+  scene.m_layout = SDFGridLayout::Linear;
+  scene.m_file = std::move(file);
+  scene.levels = std::move(levels);
+  if (scene.levels.empty()) {
+    scene.buildPyramid();
+  }
+}
+
+void saveSDFGrid(const SDFGrid &scene, const std::string &path) {
+  if (scene.values.empty()) {
+    throw std::runtime_error("Only float grids can be saved to " + path);
+  }
+  std::span<const float> linearValues = scene.values;
+  std::vector<float> gathered;
+  if (scene.layout() != SDFGridLayout::Linear) {
+    gathered.resize(static_cast<size_t>(scene.size.x) * scene.size.y *
+                    scene.size.z);
+    for (uint32_t x = 0; x < scene.size.x; ++x) {
+      for (uint32_t y = 0; y < scene.size.y; ++y) {
+        for (uint32_t z = 0; z < scene.size.z; ++z) {
+          gathered[(x * scene.size.y + y) * scene.size.z + z] =
+              scene.sdf(uint3{x, y, z});
+        }
+      }
+    }
+    linearValues = gathered;
+  }
+
+  GridHeader header = {};
+  std::memcpy(header.magic, GRID_MAGIC, sizeof(GRID_MAGIC));
+  header.version = GRID_VERSION;
+  header.size[0] = scene.size.x;
+  header.size[1] = scene.size.y;
+  header.size[2] = scene.size.z;
+  header.levelsCount = static_cast<uint32_t>(scene.levels.size());
+  header.valuesOffset = alignGridOffset(sizeof(header));
+  header.levelsOffset =
+      alignGridOffset(header.valuesOffset + linearValues.size_bytes());
+
+  std::vector<GridLevelHeader> levelHeaders(scene.levels.size());
+  uint64_t offset = alignGridOffset(
+      header.levelsOffset + levelHeaders.size() * sizeof(GridLevelHeader));
+  for (size_t levelID = 0; levelID < scene.levels.size(); ++levelID) {
+    auto &level = scene.levels[levelID];
+    levelHeaders[levelID].blockSize = level.blockSize;
+    levelHeaders[levelID].size[0] = level.size.x;
+    levelHeaders[levelID].size[1] = level.size.y;
+    levelHeaders[levelID].size[2] = level.size.z;
+    levelHeaders[levelID].valuesOffset = offset;
+    offset = alignGridOffset(offset + level.minValues.size() * sizeof(float));
+  }
+
+  std::ofstream fs(path, std::ios::binary);
+  auto writeAt = [&fs](uint64_t at, const void *pData, size_t size) {
+    static const char zeros[GRID_ALIGNMENT] = {};
+    auto padding = static_cast<std::streamsize>(at) - fs.tellp();
+    fs.write(zeros, padding);
+    fs.write(static_cast<const char *>(pData),
+             static_cast<std::streamsize>(size));
+  };
+  writeAt(0, &header, sizeof(header));
+  writeAt(header.valuesOffset, linearValues.data(), linearValues.size_bytes());
+  writeAt(header.levelsOffset, levelHeaders.data(),
+          levelHeaders.size() * sizeof(GridLevelHeader));
+  for (size_t levelID = 0; levelID < scene.levels.size(); ++levelID) {
+    writeAt(levelHeaders[levelID].valuesOffset,
+            scene.levels[levelID].minValues.data(),
+            scene.levels[levelID].minValues.size() * sizeof(float));
+  }
   fs.close();
+  if (!fs) {
+    throw std::runtime_error("Can not write " + path);
+  }
 }
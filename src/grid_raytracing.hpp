@@ -1,22 +1,138 @@
 #pragma once
 
+#include <cstdint>
+#include <span>
 #include <string>
 #include <vector>
 
 #include "LiteMath/LiteMath.h"
 
+#include "mapped_file.hpp"
 #include "raytracing.hpp"
+#include "sdf_quantization.hpp"
+#include "sphere_tracing.hpp"
+#include "trilinear.hpp"
+
+// one level of the empty space skipping pyramid
+struct SDFGridLevel {
+  uint32_t blockSize; // fine cells per block side
+  LiteMath::uint3 size; // blocks per axis
+  // lower bound of the SDF inside each block, 0 if the block may contain
+  // the surface
+  std::vector<float> minValues;
+};
+
+enum class SDFGridIntersection {
+  SphereTracing,
+  // walks the cells with a 3D-DDA and solves the trilinear cubic in cells
+  // whose corners straddle zero
+  ExactCells
+};
+
+enum class SDFGridLayout {
+  Linear, // x-major as in the .grid files
+  // 4^3 tiles, so the corners of a cell mostly share a cache line
+  Tiled
+};
 
 struct SDFGrid final : IScene {
   LiteMath::uint3 size;
-  std::vector<float> values;
+  // owned values or a view into the mapped .grid file
+  std::span<const float> values;
+  // replaces values unless the storage is Float32
+  QuantizedSDF quantized;
+  // pyramid levels from the finest to the coarsest one
+  std::vector<SDFGridLevel> levels;
+  bool skipEmptySpace = true;
+  SDFGridIntersection intersectionMode = SDFGridIntersection::SphereTracing;
+  // ray streams are sphere traced in ISPC packets
+  bool packetTracing = true;
+  MarchPolicy marchPolicy = MarchPolicy::Plain;
+  // step scale of the over-relaxed policy
+  float relaxation = 1.5f;
+  // march steps and rays are counted only when enabled, the counters are
+  // shared by all threads
+  bool countSteps = false;
+  static size_t tiledIndex(LiteMath::uint3 coords,
+                           LiteMath::uint3 tiles) noexcept {
+    size_t tile = ((coords.x >> 2) * tiles.y + (coords.y >> 2)) * tiles.z +
+                  (coords.z >> 2);
+    return tile * 64 + ((coords.x & 3) << 4) + ((coords.y & 3) << 2) +
+           (coords.z & 3);
+  }
+  size_t valueIndex(LiteMath::uint3 coords) const noexcept {
+    if (m_layout == SDFGridLayout::Tiled) {
+      return tiledIndex(coords, m_tiles);
+    }
+    return (coords.x * size.y + coords.y) * size.z + coords.z;
+  }
   float sdf(LiteMath::uint3 coords) const noexcept {
-    return values[(coords.x * size.y + coords.y) * size.z + coords.z];
+    size_t index = valueIndex(coords);
+    if (quantized.storage == SDFStorage::Float32) [[likely]] {
+      return values[index];
+    }
+    return quantized[index];
   }
   float sdf(LiteMath::float3 point) const noexcept;
+  // value and gradient in world space
+  SDFSample sample(LiteMath::float3 point) const noexcept;
+  void sample(std::span<const LiteMath::float3> points,
+              std::span<SDFSample> samples) const;
   LiteMath::float3 normal(LiteMath::float3 point) const noexcept;
   virtual HitInfo intersect(const LiteMath::float3 &rayPos,
                             const LiteMath::float3 &rayDir, float tNear,
                             float tFar) const;
+  void intersect(std::span<const Ray> rays,
+                 std::span<HitInfo> hits) const override;
+  bool occluded(const LiteMath::float3 &rayPos, const LiteMath::float3 &rayDir,
+                float tNear, float tFar) const override;
+  // takes ownership of dense values, x-major as in the .grid files
+  void setValues(LiteMath::uint3 gridSize, std::vector<float> gridValues);
+  void buildPyramid();
+  SDFGridLayout layout() const noexcept { return m_layout; }
+  // reorders float values, throws std::logic_error after quantize
+  void setLayout(SDFGridLayout layout);
+  // converts values to the quantized storage and releases them
+  void quantize(SDFStorage storage);
+  const MarchCounters &marchCounters() const noexcept {
+    return m_marchCounters;
+  }
+  void resetMarchCounters() noexcept { m_marchCounters.reset(); }
+
+private:
+  // fetches the corners of the cell containing the point
+  void locate(LiteMath::float3 point, float corners[8],
+              LiteMath::float3 &coords) const noexcept;
+  void intersectPackets(std::span<const Ray> rays,
+                        std::span<HitInfo> hits) const;
+  // cells per world unit along each axis
+  LiteMath::float3 cellScale() const noexcept;
+  // returns the exit distance of the coarsest empty block containing the
+  // point or -1 if there is none, minValue gets the lower bound of the SDF
+  // at the point
+  float emptyBlockExit(const LiteMath::float3 &point,
+                       const LiteMath::float3 &rayPos,
+                       const LiteMath::float3 &rayDir,
+                       float &minValue) const noexcept;
+  bool marchCells(const LiteMath::float3 &rayPos,
+                  const LiteMath::float3 &rayDir, float tNear, float tFar,
+                  float &tHit, LiteMath::float3 &hitPoint) const;
+  // sphere traces the ray, returns false if the surface is not reached
+  bool march(const LiteMath::float3 &rayPos, const LiteMath::float3 &rayDir,
+             float tNear, float tFar, float &tHit,
+             LiteMath::float3 &hitPoint) const;
+
+  std::vector<float> m_values;
+  MappedFile m_file;
+  SDFGridLayout m_layout = SDFGridLayout::Linear;
+  LiteMath::uint3 m_tiles = {0, 0, 0};
+  mutable MarchCounters m_marchCounters;
+
+  friend void loadSDFGrid(SDFGrid &scene, const std::string &path);
 };
+
+// reads both the headerless legacy files and the .grid v2 ones, throws
+// std::runtime_error on malformed files
 void loadSDFGrid(SDFGrid &scene, const std::string &path);
+// writes a .grid v2 file including the empty space skipping pyramid
+void saveSDFGrid(const SDFGrid &scene, const std::string &path);
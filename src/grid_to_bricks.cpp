@@ -0,0 +1,32 @@
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+
+#include <brick_raytracing.hpp>
+#include <grid_raytracing.hpp>
+
+// Converts a dense .grid file into a sparse brick grid.
+//
+// usage: grid_to_bricks input.grid output.bricks [band_width_in_cells]
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    std::cerr << "usage: " << argv[0]
+              << " input.grid output.bricks [band_width_in_cells]"
+              << std::endl;
+    return 1;
+  }
+  float bandWidth = argc > 3 ? std::strtof(argv[3], nullptr) : 2.0f;
+
+  try {
+    SDFGrid grid;
+    loadSDFGrid(grid, argv[1]);
+    SDFBrickGrid bricks;
+    convertSDFGrid(grid, bricks, bandWidth);
+    saveSDFBrickGrid(bricks, argv[2]);
+  } catch (const std::runtime_error &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
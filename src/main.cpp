@@ -17,10 +17,12 @@ static_assert(false, "This code is valid for Ubuntu x64 linux");
 #include <SDL_keycode.h>
 
 #include "octree_raytracing.hpp"
+#include <brick_raytracing.hpp>
 #include <camera.hpp>
 #include <grid_raytracing.hpp>
 #include <imgui_adaptors.hpp>
 #include <mesh.h>
+#include <scene_loader.hpp>
 #include <sdl_adaptors.hpp>
 #include <triangles_raytracing.hpp>
 
@@ -42,7 +44,28 @@ struct ApplicationState {
   Camera camera;
 };
 void pollEvents(ApplicationState &state);
-cmesh4::SimpleMesh loadAndScale(std::filesystem::path path);
+
+// sphere tracing policy of grids and octrees, step statistics are shown for
+// the last frame
+template <typename SDFScene> void marchPolicyControls(SDFScene &scene) {
+  bool overRelaxed = scene.marchPolicy == MarchPolicy::OverRelaxed;
+  ImGui::Checkbox("Over-relaxed sphere tracing", &overRelaxed);
+  scene.marchPolicy =
+      overRelaxed ? MarchPolicy::OverRelaxed : MarchPolicy::Plain;
+  if (overRelaxed) {
+    ImGui::SliderFloat("Relaxation", &scene.relaxation, 1.0f, 2.0f);
+  }
+  ImGui::Checkbox("Count march steps", &scene.countSteps);
+  if (scene.countSteps) {
+    ImGui::Text("\tSteps per ray: %.2f", scene.marchCounters().stepsPerRay());
+    // only hierarchies count visits
+    if (scene.marchCounters().visits() > 0) {
+      ImGui::Text("\tNode visits per ray: %.2f",
+                  scene.marchCounters().visitsPerRay());
+    }
+    scene.resetMarchCounters();
+  }
+}
 
 int main(int, char **) {
   ApplicationState state;
@@ -66,6 +89,9 @@ int main(int, char **) {
   cmesh4::SimpleMesh mesh;
   std::future<void> asyncResult;
   bool needToLoadModel = false;
+  bool binnedBVH = false;
+  bool compressedBVH = false;
+  bool tiledGrid = false;
   int dotsCount = 3;
 
   int currentShadingMode = 1;
@@ -73,6 +99,16 @@ int main(int, char **) {
                                  ShadingMode::Normal};
   const char *shadinModesStr[3] = {"Color", "Lambert", "Normal"};
 
+  int currentTileOrder = 1;
+  TileOrder tileOrders[3] = {TileOrder::Scanline, TileOrder::Morton,
+                             TileOrder::Hilbert};
+  const char *tileOrdersStr[3] = {"Scanline", "Morton", "Hilbert"};
+
+  int currentSDFStorage = 0;
+  SDFStorage sdfStorages[3] = {SDFStorage::Float32, SDFStorage::Int16,
+                               SDFStorage::Int8};
+  const char *sdfStoragesStr[3] = {"32 bit float", "16 bit", "8 bit"};
+
   auto &sdlManager = sdl_adapters::SDLManager::getInstance();
   sdlManager.tryToInitialize(SDL_INIT_VIDEO | SDL_INIT_TIMER);
 
@@ -145,6 +181,10 @@ int main(int, char **) {
                                      ImGuiWindowFlags_NoResize |
                                          ImGuiWindowFlags_NoMove);
       ImGui::Text("Mesh Settings:");
+      ImGui::Checkbox("Binned SAH BVH", &binnedBVH);
+      ImGui::Checkbox("Compressed BVH nodes", &compressedBVH);
+      ImGui::Checkbox("Tiled grid layout", &tiledGrid);
+      ImGui::ListBox("SDF Storage", &currentSDFStorage, sdfStoragesStr, 3);
       if (ImGui::Button("Load mesh")) {
         needToLoadModel = true;
         state.modelLoaded = false;
@@ -152,7 +192,8 @@ int main(int, char **) {
             "zenity --file-selection --title=\"Select model\" --filename=\""s +
             mesh_path.c_str() +
             "\" --file-filter=\"OBJ Files | *.obj\" --file-filter=\"Grid Files "
-            "| *.grid\" --file-filter=\"Octree Files | *.octree\"";
+            "| *.grid\" --file-filter=\"Brick Grid Files | *.bricks\" "
+            "--file-filter=\"Octree Files | *.octree\"";
         FILE *pipe = popen(command.c_str(), "r");
         char buffer[PATH_MAX + 1] = {};
         std::string result = "";
@@ -170,19 +211,36 @@ int main(int, char **) {
             mesh = loadAndScale(mesh_path);
             modelBox = calc_bbox(mesh);
             auto pBVHScene = std::make_shared<BVHBuilder>();
-            pBVHScene->perform(std::move(mesh));
+            pBVHScene->buildMode = binnedBVH ? BVHBuildMode::BinnedSAH
+                                             : BVHBuildMode::SortedSAH;
+            pBVHScene->nodeLayout = compressedBVH ? BVHNodeLayout::Compressed
+                                                  : BVHNodeLayout::Full;
+            auto cachePath = mesh_path;
+            cachePath.replace_extension(".bvh");
+            pBVHScene->performCached(std::move(mesh), cachePath.string());
             pScene = pBVHScene;
           } else if (mesh_path.extension() == ".grid") {
             modelBox.boxMin = float3{-1.0f};
             modelBox.boxMax = float3{1.0f};
             std::shared_ptr<SDFGrid> pGrid = std::make_shared<SDFGrid>();
             loadSDFGrid(*pGrid, mesh_path.string());
+            pGrid->setLayout(tiledGrid ? SDFGridLayout::Tiled
+                                       : SDFGridLayout::Linear);
+            pGrid->quantize(sdfStorages[currentSDFStorage]);
             pScene = pGrid;
+          } else if (mesh_path.extension() == ".bricks") {
+            modelBox.boxMin = float3{-1.0f};
+            modelBox.boxMax = float3{1.0f};
+            std::shared_ptr<SDFBrickGrid> pBricks =
+                std::make_shared<SDFBrickGrid>();
+            loadSDFBrickGrid(*pBricks, mesh_path.string());
+            pScene = pBricks;
           } else if (mesh_path.extension() == ".octree") {
             modelBox.boxMin = float3{-1.0f};
             modelBox.boxMax = float3{1.0f};
             std::shared_ptr<SDFOctree> pOctree = std::make_shared<SDFOctree>();
             loadSDFOctree(*pOctree, mesh_path.string());
+            pOctree->quantize(sdfStorages[currentSDFStorage]);
             pScene = pOctree;
           }
 
@@ -224,6 +282,37 @@ int main(int, char **) {
         ImGui::Checkbox("Enable shadows", &renderer.enableShadows);
         ImGui::Checkbox("Enable reflections", &renderer.enableReflections);
       }
+      ImGui::Checkbox("Ray streams", &renderer.enableRayStreams);
+      if (state.modelLoaded) {
+        if (auto pGrid = std::dynamic_pointer_cast<SDFGrid>(pScene)) {
+          ImGui::Checkbox("Skip empty space", &pGrid->skipEmptySpace);
+          ImGui::Checkbox("Packet sphere tracing", &pGrid->packetTracing);
+          bool exactCells =
+              pGrid->intersectionMode == SDFGridIntersection::ExactCells;
+          ImGui::Checkbox("Exact cell intersection", &exactCells);
+          pGrid->intersectionMode = exactCells
+                                        ? SDFGridIntersection::ExactCells
+                                        : SDFGridIntersection::SphereTracing;
+          marchPolicyControls(*pGrid);
+        } else if (auto pOctree =
+                       std::dynamic_pointer_cast<SDFOctree>(pScene)) {
+          // cones are only traced by ray streams
+          if (renderer.enableRayStreams) {
+            ImGui::Checkbox("Pixel footprint LOD", &renderer.enableRayCones);
+          }
+          bool useRopes = pOctree->traversal == OctreeTraversal::Ropes;
+          ImGui::Checkbox("Rope traversal", &useRopes);
+          if (useRopes && !pOctree->hasRopes()) {
+            pOctree->buildRopes();
+          }
+          pOctree->traversal =
+              useRopes ? OctreeTraversal::Ropes : OctreeTraversal::Stack;
+          marchPolicyControls(*pOctree);
+        }
+      }
+      ImGui::SliderInt("Tile Size", &renderer.tileSize, 4, 128);
+      ImGui::ListBox("Tile Order", &currentTileOrder, tileOrdersStr, 3);
+      renderer.tileOrder = tileOrders[currentTileOrder];
       float3 up = state.camera.up();
       float3 right = state.camera.right();
       ImGui::Text("Debug Info:");
@@ -232,6 +321,13 @@ int main(int, char **) {
                   right.z);
       ImGui::Text("\tWindow Resolution: %dx%d", state.W, state.H);
       ImGui::Text("\tRender Time: %.03fms", time);
+      auto &frameStats = renderer.frameStats();
+      ImGui::Text("\tTiles: %u", frameStats.tilesCount);
+      for (size_t thread = 0; thread < frameStats.threadTime.size(); ++thread) {
+        ImGui::Text("\t\tThread %zu: %u tiles, %.03fms", thread,
+                    frameStats.threadTiles[thread],
+                    frameStats.threadTime[thread]);
+      }
     }
 
     // Rendering
@@ -322,22 +418,3 @@ void pollEvents(ApplicationState &state) {
     }
   }
 }
-
-cmesh4::SimpleMesh loadAndScale(std::filesystem::path path) {
-  auto mesh = LoadMeshFromObj(path.c_str(), true);
-
-  auto bbox = calc_bbox(mesh);
-  auto center = (bbox.boxMin + bbox.boxMax) / 2.0f;
-  auto scale = length(bbox.boxMax - center);
-  for (auto &v : mesh.vPos4f) {
-    auto w = v.w;
-    v /= w;
-    float3 scaled = to_float3(v);
-    scaled -= center;
-    scaled /= scale;
-    v = to_float4(scaled, 1.0f);
-    v *= w;
-  }
-
-  return mesh;
-}
\ No newline at end of file
@@ -0,0 +1,54 @@
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+
+#include "mapped_file.hpp"
+
+MappedFile::MappedFile(const std::string &path) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("Can not open " + path);
+  }
+
+  struct stat fileStat = {};
+  if (fstat(fd, &fileStat) != 0 || fileStat.st_size <= 0) {
+    ::close(fd);
+    throw std::runtime_error("Can not map empty file " + path);
+  }
+
+  auto size = static_cast<size_t>(fileStat.st_size);
+  void *pData = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (pData == MAP_FAILED) {
+    throw std::runtime_error("Can not map " + path);
+  }
+
+  m_data = static_cast<const std::byte *>(pData);
+  m_size = size;
+}
+
+MappedFile::MappedFile(MappedFile &&other) noexcept
+    : m_data(std::exchange(other.m_data, nullptr)),
+      m_size(std::exchange(other.m_size, 0)) {}
+
+MappedFile &MappedFile::operator=(MappedFile &&other) noexcept {
+  if (this != &other) {
+    close();
+    m_data = std::exchange(other.m_data, nullptr);
+    m_size = std::exchange(other.m_size, 0);
+  }
+  return *this;
+}
+
+void MappedFile::close() noexcept {
+  if (m_data != nullptr) {
+    munmap(const_cast<std::byte *>(m_data), m_size);
+    m_data = nullptr;
+    m_size = 0;
+  }
+}
+
+MappedFile::~MappedFile() { close(); }
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+// read-only memory mapping of a whole file, pages are loaded lazily on access
+class MappedFile {
+public:
+  MappedFile() noexcept = default;
+  explicit MappedFile(const std::string &path);
+  MappedFile(const MappedFile &) = delete;
+  MappedFile(MappedFile &&other) noexcept;
+
+public:
+  MappedFile &operator=(const MappedFile &) = delete;
+  MappedFile &operator=(MappedFile &&other) noexcept;
+
+public:
+  const std::byte *data() const noexcept { return m_data; }
+  size_t size() const noexcept { return m_size; }
+  bool isOpen() const noexcept { return m_data != nullptr; }
+  void close() noexcept;
+
+private:
+  const std::byte *m_data = nullptr;
+  size_t m_size = 0;
+
+public:
+  ~MappedFile();
+};
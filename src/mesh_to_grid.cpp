@@ -0,0 +1,37 @@
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+
+#include <grid_raytracing.hpp>
+#include <scene_loader.hpp>
+#include <sdf_baker.hpp>
+#include <triangles_raytracing.hpp>
+
+// Bakes an .obj mesh into a dense .grid file.
+//
+// usage: mesh_to_grid input.obj output.grid [resolution]
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    std::cerr << "usage: " << argv[0] << " input.obj output.grid [resolution]"
+              << std::endl;
+    return 1;
+  }
+  long resolution = argc > 3 ? std::strtol(argv[3], nullptr, 10) : 128;
+  if (resolution < 2) {
+    std::cerr << "resolution must be at least 2" << std::endl;
+    return 1;
+  }
+
+  try {
+    BVHBuilder bvh;
+    bvh.perform(loadAndScale(argv[1]));
+    SDFGrid grid;
+    bakeSDFGrid(bvh, static_cast<uint32_t>(resolution), grid);
+    saveSDFGrid(grid, argv[2]);
+  } catch (const std::runtime_error &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,38 @@
+#include <cstdlib>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+
+#include <octree_raytracing.hpp>
+#include <scene_loader.hpp>
+#include <sdf_baker.hpp>
+#include <triangles_raytracing.hpp>
+
+// Bakes an .obj mesh into an adaptive .octree file.
+//
+// usage: mesh_to_octree input.obj output.octree [max_depth]
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    std::cerr << "usage: " << argv[0] << " input.obj output.octree [max_depth]"
+              << std::endl;
+    return 1;
+  }
+  long maxDepth = argc > 3 ? std::strtol(argv[3], nullptr, 10) : 8;
+  if (maxDepth < 1 || maxDepth > 12) {
+    std::cerr << "max_depth must be in [1, 12]" << std::endl;
+    return 1;
+  }
+
+  try {
+    BVHBuilder bvh;
+    bvh.perform(loadAndScale(argv[1]));
+    std::vector<SDFOctreeNode> nodes;
+    bakeSDFOctree(bvh, static_cast<uint32_t>(maxDepth), nodes);
+    saveSDFOctree(nodes, argv[2]);
+  } catch (const std::runtime_error &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
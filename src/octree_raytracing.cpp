@@ -1,208 +1,578 @@
+#include <algorithm>
+#include <cmath>
 #include <fstream>
+#include <iostream>
+#include <limits>
+#include <stdexcept>
 
 #include "octree_raytracing.hpp"
-#include <ray_pack_ispc.h>
 
 using namespace LiteMath;
 
+constexpr float HIT_EPS = 1e-4f;
+// values above it mark empty nodes, see SDFOctreeNode::isEmpty
+constexpr float EMPTY_VALUE = 10.0f;
+
 void loadSDFOctree(SDFOctree &scene, const std::string &path) {
   std::ifstream fs(path, std::ios::binary);
-  unsigned sz = 0;
-  fs.read((char *)&sz, sizeof(unsigned));
-  scene.nodes.resize(sz);
-  fs.read((char *)scene.nodes.data(),
-          scene.nodes.size() * sizeof(SDFOctreeNode));
-  fs.close();
+  uint32_t nodesCount = 0;
+  fs.read(reinterpret_cast<char *>(&nodesCount), sizeof(nodesCount));
+  if (!fs || nodesCount == 0 || nodesCount >= OCTREE_LEAF_BIT) {
+    throw std::runtime_error(path + " is not an octree");
+  }
+  std::vector<SDFOctreeNode> nodes(nodesCount);
+  fs.read(reinterpret_cast<char *>(nodes.data()),
+          static_cast<std::streamsize>(nodes.size() * sizeof(SDFOctreeNode)));
+  if (!fs) {
+    throw std::runtime_error(path + " is truncated");
+  }
+  // children have to follow their parent, so that offsets can not form
+  // cycles
+  for (uint32_t nodeID = 0; nodeID < nodesCount; ++nodeID) {
+    auto &node = nodes[nodeID];
+    if (!node.isLeaf() &&
+        (nodesCount < 8 || node.childrenOffset > nodesCount - 8 ||
+         node.childrenOffset <= nodeID)) {
+      throw std::runtime_error(path + " has invalid child offsets");
+    }
+  }
+  scene.setNodes(nodes);
 }
 
-float SDFOctree::nodeSDF(size_t nodeID, const LiteMath::BBox3f &nodeBox,
-                         LiteMath::float3 point) const {
-  point = (point - nodeBox.boxMin) / (nodeBox.boxMax - nodeBox.boxMin);
-  point = clamp(point, float3{0.0000001f}, float3{0.9999999f});
-
-  float3 c0f = floor(point);
-  float3 c1f = ceil(point);
-
-  uint3 c0 = {static_cast<uint32_t>(c0f.x), static_cast<uint32_t>(c0f.y),
-              static_cast<uint32_t>(c0f.z)};
-
-  uint3 c1 = {static_cast<uint32_t>(c1f.x), static_cast<uint32_t>(c1f.y),
-              static_cast<uint32_t>(c1f.z)};
-
-  float3 p_c0f = point - c0f;
-  float3 c1f_p = c1f - point;
-
-  float p[8] = {};
-  p[0] = nodeSDF(nodeID, uint3{c0.x, c0.y, c0.z});
-  p[1] = nodeSDF(nodeID, uint3{c0.x, c0.y, c1.z});
-  p[2] = nodeSDF(nodeID, uint3{c0.x, c1.y, c0.z});
-  p[3] = nodeSDF(nodeID, uint3{c0.x, c1.y, c1.z});
-  p[4] = nodeSDF(nodeID, uint3{c1.x, c0.y, c0.z});
-  p[5] = nodeSDF(nodeID, uint3{c1.x, c0.y, c1.z});
-  p[6] = nodeSDF(nodeID, uint3{c1.x, c1.y, c0.z});
-  p[7] = nodeSDF(nodeID, uint3{c1.x, c1.y, c1.z});
-
-  float res = 0.0f;
-  res += p[0] * c1f_p.x * c1f_p.y * c1f_p.z;
-  res += p[1] * c1f_p.x * c1f_p.y * p_c0f.z;
-  res += p[2] * c1f_p.x * p_c0f.y * c1f_p.z;
-  res += p[3] * c1f_p.x * p_c0f.y * p_c0f.z;
-
-  res += p[4] * p_c0f.x * c1f_p.y * c1f_p.z;
-  res += p[5] * p_c0f.x * c1f_p.y * p_c0f.z;
-  res += p[6] * p_c0f.x * p_c0f.y * c1f_p.z;
-  res += p[7] * p_c0f.x * p_c0f.y * p_c0f.z;
-
-  return res;
-}
-
-constexpr float NORMAL_EPS = 1e-6f;
-LiteMath::float3 SDFOctree::nodeNormal(size_t nodeID,
-                                       const LiteMath::BBox3f &nodeBox,
-                                       LiteMath::float3 point) const {
-  point = (point - nodeBox.boxMin) / (nodeBox.boxMax - nodeBox.boxMin);
-  point = clamp(point, float3{0.0000001f}, float3{0.9999999f});
-
-  float3 c0f = floor(point);
-  float3 c1f = ceil(point);
-
-  uint3 c0 = {static_cast<uint32_t>(c0f.x), static_cast<uint32_t>(c0f.y),
-              static_cast<uint32_t>(c0f.z)};
-
-  uint3 c1 = {static_cast<uint32_t>(c1f.x), static_cast<uint32_t>(c1f.y),
-              static_cast<uint32_t>(c1f.z)};
-
-  float3 p_c0f = point - c0f;
-  float3 c1f_p = c1f - point;
-  float3 dp_c0f = float3{1.0f};
-  float3 dc1f_p = float3{-1.0f};
-
-  float p[8] = {};
-  p[0] = nodeSDF(nodeID, uint3{c0.x, c0.y, c0.z});
-  p[1] = nodeSDF(nodeID, uint3{c0.x, c0.y, c1.z});
-  p[2] = nodeSDF(nodeID, uint3{c0.x, c1.y, c0.z});
-  p[3] = nodeSDF(nodeID, uint3{c0.x, c1.y, c1.z});
-  p[4] = nodeSDF(nodeID, uint3{c1.x, c0.y, c0.z});
-  p[5] = nodeSDF(nodeID, uint3{c1.x, c0.y, c1.z});
-  p[6] = nodeSDF(nodeID, uint3{c1.x, c1.y, c0.z});
-  p[7] = nodeSDF(nodeID, uint3{c1.x, c1.y, c1.z});
-
-  float dfdx = p[0] * dc1f_p.x * c1f_p.y * c1f_p.z +
-               p[1] * dc1f_p.x * c1f_p.y * p_c0f.z +
-               p[2] * dc1f_p.x * p_c0f.y * c1f_p.z +
-               p[3] * dc1f_p.x * p_c0f.y * p_c0f.z +
-               p[4] * dp_c0f.x * c1f_p.y * c1f_p.z +
-               p[5] * dp_c0f.x * c1f_p.y * p_c0f.z +
-               p[6] * dp_c0f.x * p_c0f.y * c1f_p.z +
-               p[7] * dp_c0f.x * p_c0f.y * p_c0f.z;
-
-  float dfdy = p[0] * c1f_p.x * dc1f_p.y * c1f_p.z +
-               p[1] * c1f_p.x * dc1f_p.y * p_c0f.z +
-               p[2] * c1f_p.x * dp_c0f.y * c1f_p.z +
-               p[3] * c1f_p.x * dp_c0f.y * p_c0f.z +
-               p[4] * p_c0f.x * dc1f_p.y * c1f_p.z +
-               p[5] * p_c0f.x * dc1f_p.y * p_c0f.z +
-               p[6] * p_c0f.x * dp_c0f.y * c1f_p.z +
-               p[7] * p_c0f.x * dp_c0f.y * p_c0f.z;
-
-  float dfdz = p[0] * c1f_p.x * c1f_p.y * dc1f_p.z +
-               p[1] * c1f_p.x * c1f_p.y * dp_c0f.z +
-               p[2] * c1f_p.x * p_c0f.y * dc1f_p.z +
-               p[3] * c1f_p.x * p_c0f.y * dp_c0f.z +
-               p[4] * p_c0f.x * c1f_p.y * dc1f_p.z +
-               p[5] * p_c0f.x * c1f_p.y * dp_c0f.z +
-               p[6] * p_c0f.x * p_c0f.y * dc1f_p.z +
-               p[7] * p_c0f.x * p_c0f.y * dp_c0f.z;
-  
-  return normalize(float3{dfdx, dfdy, dfdz});
+void saveSDFOctree(std::span<const SDFOctreeNode> nodes,
+                   const std::string &path) {
+  std::ofstream fs(path, std::ios::binary);
+  auto nodesCount = static_cast<uint32_t>(nodes.size());
+  fs.write(reinterpret_cast<const char *>(&nodesCount), sizeof(nodesCount));
+  fs.write(reinterpret_cast<const char *>(nodes.data()),
+           static_cast<std::streamsize>(nodes.size_bytes()));
+  fs.close();
+  if (!fs) {
+    throw std::runtime_error("Can not write " + path);
+  }
 }
 
-constexpr float HIT_EPS = 1e-4f;
-
-HitInfo SDFOctree::intersectLeaf(size_t nodeID, const LiteMath::BBox3f &nodeBox,
-                                 const LiteMath::float3 &rayPos,
-                                 const LiteMath::float3 &rayDir, float tNear,
-                                 float tFar) const {
-  HitInfo result;
-
-  if (nodes[nodeID].isEmpty()) {
-    return result; // no hit
+// value at corner of the node, corner i of a node is corner i of its child i
+static float cornerValue(std::span<const SDFOctreeNode> fileNodes,
+                         uint32_t nodeID, uint32_t corner) {
+  while (!fileNodes[nodeID].isLeaf()) {
+    nodeID = fileNodes[nodeID].childrenOffset + corner;
   }
+  auto &leaf = fileNodes[nodeID];
+  return leaf.isEmpty() ? std::max(leaf.values[corner], EMPTY_VALUE)
+                        : leaf.values[corner];
+}
 
-  if (std::all_of(nodes[nodeID].values, nodes[nodeID].values + 8,
-                  [](float v) { return v >= HIT_EPS; })) {
-    return result; // no hit
+void SDFOctree::setNodes(std::span<const SDFOctreeNode> fileNodes) {
+  m_topology.clear();
+  m_leafValues.clear();
+  m_innerValues.clear();
+  m_ropes.clear();
+  quantized = {};
+  // file indices of the nodes in breadth first order
+  std::vector<uint32_t> order = {0};
+  // levels are contiguous in the breadth first order
+  size_t levelEnd = 1;
+  uint32_t depth = 0;
+  for (size_t nodeID = 0; nodeID < order.size(); ++nodeID) {
+    if (nodeID == levelEnd) {
+      levelEnd = order.size();
+      ++depth;
+    }
+    auto &node = fileNodes[order[nodeID]];
+    if (!node.isLeaf()) {
+      if (order.size() + 8 > fileNodes.size()) {
+        throw std::runtime_error("SDF octree nodes have several parents");
+      }
+      if (depth == OCTREE_MAX_DEPTH) {
+        throw std::runtime_error("SDF octree is deeper than " +
+                                 std::to_string(OCTREE_MAX_DEPTH) +
+                                 " levels");
+      }
+      m_topology.push_back(static_cast<uint32_t>(order.size()));
+      for (uint32_t childID = 0; childID < 8; ++childID) {
+        order.push_back(node.childrenOffset + childID);
+        m_innerValues.push_back(
+            cornerValue(fileNodes, order[nodeID], childID));
+      }
+      continue;
+    }
+    // trilinear values stay above the smallest corner, so such leaves can
+    // not be hit and keep no values
+    if (node.isEmpty() || *std::min_element(node.values, node.values + 8) >=
+                              HIT_EPS) {
+      m_topology.push_back(OCTREE_EMPTY_LEAF);
+      continue;
+    }
+    m_topology.push_back(OCTREE_LEAF_BIT |
+                         static_cast<uint32_t>(m_leafValues.size() / 8));
+    m_leafValues.insert(m_leafValues.end(), node.values, node.values + 8);
   }
+  m_topology.shrink_to_fit();
+  m_leafValues.shrink_to_fit();
+  m_innerValues.shrink_to_fit();
+  m_leavesCount = m_leafValues.size() / 8;
+
+  float fileMB = static_cast<float>(fileNodes.size() * sizeof(SDFOctreeNode)) /
+                 (1024.0f * 1024.0f);
+  float splitMB = static_cast<float>(m_topology.size() * sizeof(uint32_t) +
+                                     m_leafValues.size() * sizeof(float) +
+                                     m_innerValues.size() * sizeof(float)) /
+                  (1024.0f * 1024.0f);
+  std::cout << "SDF octree: " << m_topology.size() << " nodes, "
+            << m_leavesCount << " leaves with surface, " << splitMB
+            << "MB instead of " << fileMB << "MB" << std::endl;
+}
+
+float SDFOctree::leafSDF(const float corners[8],
+                         const LiteMath::BBox3f &leafBox,
+                         LiteMath::float3 point) {
+  point = (point - leafBox.boxMin) / (leafBox.boxMax - leafBox.boxMin);
+  point = clamp(point, float3{0.0f}, float3{1.0f});
+  return trilinear(corners, point);
+}
 
+LiteMath::float3 SDFOctree::leafNormal(const float corners[8],
+                                       const LiteMath::BBox3f &leafBox,
+                                       LiteMath::float3 point) {
+  point = (point - leafBox.boxMin) / (leafBox.boxMax - leafBox.boxMin);
+  point = clamp(point, float3{0.0f}, float3{1.0f});
+  // nodes are cubes, so the local gradient has the world space direction
+  return normalize(trilinearWithGradient(corners, point).gradient);
+}
+
+bool SDFOctree::marchLeaf(const float corners[8],
+                          const LiteMath::BBox3f &leafBox,
+                          const LiteMath::float3 &rayPos,
+                          const LiteMath::float3 &rayDir, float tNear,
+                          float tFar, float &tHit,
+                          LiteMath::float3 &hitPoint) const {
   auto boxIntersection =
-      nodeBox.Intersection(rayPos, 1.0f / rayDir, tNear, tFar);
+      leafBox.Intersection(rayPos, 1.0f / rayDir, tNear, tFar);
   if (boxIntersection.t1 > boxIntersection.t2) {
-    return result; // no hit
+    return false; // no hit
   }
 
   float t = boxIntersection.t1;
   float3 curPoint = rayPos + t * rayDir;
-  curPoint = max(curPoint, nodeBox.boxMin);
-  curPoint = min(curPoint, nodeBox.boxMax);
+  curPoint = max(curPoint, leafBox.boxMin);
+  curPoint = min(curPoint, leafBox.boxMax);
+
+  bool hit = false;
+  uint64_t steps = 0;
+  SphereStepper stepper(marchPolicy, relaxation, t);
+  while (true) {
+    if (!all_of(curPoint <= float3{leafBox.boxMax}) ||
+        !all_of(curPoint >= float3{leafBox.boxMin})) {
+      // an over-relaxed step may have left the leaf past the surface
+      if (stepper.verify(t, 0.0f)) {
+        break;
+      }
+      curPoint = rayPos + t * rayDir;
+      continue;
+    }
 
-  while (all_of(curPoint <= float3{nodeBox.boxMax}) &&
-         all_of(curPoint >= float3{nodeBox.boxMin})) {
-    float curSdf = nodeSDF(nodeID, nodeBox, curPoint);
+    ++steps;
+    float curSdf = leafSDF(corners, leafBox, curPoint);
+    if (!stepper.verify(t, curSdf)) {
+      curPoint = rayPos + t * rayDir;
+      continue;
+    }
 
     if (curSdf < HIT_EPS) {
-      result.hitten = true;
-      result.t = t + curSdf;
-      result.normal = nodeNormal(nodeID, nodeBox, curPoint);
+      tHit = t + curSdf;
+      hitPoint = curPoint;
+      hit = true;
       break;
     }
 
-    t += curSdf;
+    t = stepper.advance(t, curSdf);
     curPoint = rayPos + t * rayDir;
   }
 
-  return result;
+  if (countSteps) {
+    m_marchCounters.add(steps, 0);
+  }
+  return hit;
 }
 
-HitInfo SDFOctree::intersectNode(size_t nodeID, const LiteMath::float3 &rayPos,
+HitInfo SDFOctree::intersectLeaf(const float corners[8],
+                                 const LiteMath::BBox3f &leafBox,
+                                 const LiteMath::float3 &rayPos,
                                  const LiteMath::float3 &rayDir, float tNear,
-                                 float tFar,
-                                 const LiteMath::BBox3f &nodeBox) const {
-  auto &node = nodes[nodeID];
-  if (node.isLeaf()) {
-    return intersectLeaf(nodeID, nodeBox, rayPos, rayDir, tNear, tFar);
+                                 float tFar) const {
+  HitInfo result;
+  float3 hitPoint;
+  if (marchLeaf(corners, leafBox, rayPos, rayDir, tNear, tFar, result.t,
+                hitPoint)) {
+    result.hitten = true;
+    result.normal = leafNormal(corners, leafBox, hitPoint);
   }
+  return result;
+}
 
-  ispc::Box8 boxesSOA;
-  ispc::divide_box_8(reinterpret_cast<const ispc::Box *>(&nodeBox), &boxesSOA);
+bool SDFOctree::nodeValues(uint32_t node, float corners[8]) const {
+  if ((node & OCTREE_LEAF_BIT) != 0) {
+    if (node == OCTREE_EMPTY_LEAF) {
+      return false;
+    }
+    leafValues(node & ~OCTREE_LEAF_BIT, corners);
+    return true;
+  }
+  auto innerID = static_cast<ptrdiff_t>((node - 1) / 8);
+  std::copy_n(m_innerValues.begin() + innerID * 8, 8, corners);
+  return *std::min_element(corners, corners + 8) < HIT_EPS;
+}
 
-  float ts[8] = {};
-  float3 invDir = 1.0f / rayDir;
-  ispc::intersect_box_8(&boxesSOA, rayPos.M, invDir.M, tNear, tFar, ts);
-  size_t children[8] = {0, 1, 2, 3, 4, 5, 6, 7};
-  sort8(ts, children);
+bool SDFOctree::hitNode(const float corners[8], const LiteMath::BBox3f &box,
+                        const LiteMath::float3 &rayPos,
+                        const LiteMath::float3 &rayDir, float tNear, float tFar,
+                        bool anyHit, HitInfo &result) const {
+  if (anyHit) {
+    float t = 0.0f;
+    float3 hitPoint;
+    if (marchLeaf(corners, box, rayPos, rayDir, tNear, tFar, t, hitPoint) &&
+        t <= tFar) {
+      result.hitten = true;
+      result.t = t;
+      return true;
+    }
+    return false;
+  }
+  result = intersectLeaf(corners, box, rayPos, rayDir, tNear, tFar);
+  return result.hitten;
+}
+
+// every level on the path keeps at most 3 pending children, setNodes
+// rejects trees deeper than the stack holds
+constexpr size_t OCTREE_STACK_SIZE = 3 * OCTREE_MAX_DEPTH + 1;
+
+HitInfo SDFOctree::traverse(const LiteMath::float3 &rayPos,
+                            const LiteMath::float3 &rayDir, float tNear,
+                            float tFar, float spread, bool anyHit,
+                            uint64_t &visits) const {
+  if (traversal == OctreeTraversal::Ropes && !m_ropes.empty()) {
+    return traverseRopes(rayPos, rayDir, tNear, tFar, spread, anyHit, visits);
+  }
 
   HitInfo result;
-  for (size_t i = 0; i < 8; ++i) {
-    size_t childID = children[i];
-    float t = ts[i];
-    if (t > 0 && (!result.hitten || result.t > t)) {
-      BBox3f childBox;
-      childBox.boxMin = { boxesSOA.xMin[childID], boxesSOA.yMin[childID], boxesSOA.zMin[childID] };
-      childBox.boxMax = { boxesSOA.xMax[childID], boxesSOA.yMax[childID], boxesSOA.zMax[childID] };
-      auto childHit = intersectNode(node.childrenOffset + childID, rayPos,
-                                    rayDir, tNear, tFar, childBox);
-      if (childHit.hitten) {
-        result = childHit;
-        break;
+  float3 invDir = 1.0f / rayDir;
+  // cone width per unit of t
+  float coneSpread = spread * length(rayDir);
+  auto rootIntersection = BBox3f{float3{-1.0f}, float3{1.0f}}.Intersection(
+      rayPos, invDir, tNear, tFar);
+  if (rootIntersection.t1 > rootIntersection.t2) {
+    return result;
+  }
+
+  struct StackEntry {
+    uint32_t nodeID;
+    float3 boxMin;
+    float size;
+    float tEnter;
+    float tExit;
+  };
+  StackEntry stack[OCTREE_STACK_SIZE];
+  size_t stackSize = 0;
+  stack[stackSize++] = {0, float3{-1.0f}, 2.0f, rootIntersection.t1,
+                        rootIntersection.t2};
+
+  while (stackSize > 0) {
+    auto [nodeID, boxMin, size, tEnter, tExit] = stack[--stackSize];
+    uint32_t node = m_topology[nodeID];
+    ++visits;
+    // nodes below the pixel footprint are marched as leaves with the corner
+    // values of the subtree
+    if ((node & OCTREE_LEAF_BIT) != 0 || size < coneSpread * tEnter) {
+      float corners[8];
+      if (nodeValues(node, corners) &&
+          hitNode(corners, BBox3f{boxMin, boxMin + size}, rayPos, rayDir,
+                  tNear, tFar, anyHit, result)) {
+        return result;
+      }
+      continue;
+    }
+
+    // the child at tEnter follows from the side of every splitting plane,
+    // each plane crossed before tExit then flips one bit of the child index
+    float half = size * 0.5f;
+    float3 center = boxMin + half;
+    float tPlane[3];
+    uint32_t childID = 0;
+    for (int axis = 0; axis < 3; ++axis) {
+      uint32_t bit = 4u >> axis;
+      if (rayDir[axis] == 0.0f) {
+        tPlane[axis] = std::numeric_limits<float>::infinity();
+        childID |= rayPos[axis] >= center[axis] ? bit : 0u;
+        continue;
       }
+      tPlane[axis] = (center[axis] - rayPos[axis]) * invDir[axis];
+      bool crossed = tPlane[axis] <= tEnter;
+      childID |= (rayDir[axis] > 0.0f) == crossed ? bit : 0u;
+    }
+
+    int axes[3] = {0, 1, 2};
+    if (tPlane[axes[0]] > tPlane[axes[1]]) {
+      std::swap(axes[0], axes[1]);
+    }
+    if (tPlane[axes[1]] > tPlane[axes[2]]) {
+      std::swap(axes[1], axes[2]);
+    }
+    if (tPlane[axes[0]] > tPlane[axes[1]]) {
+      std::swap(axes[0], axes[1]);
+    }
+
+    uint32_t children[4] = {childID};
+    float bounds[5] = {tEnter};
+    size_t count = 1;
+    for (int axis : axes) {
+      if (tPlane[axis] > tEnter && tPlane[axis] < tExit) {
+        bounds[count] = tPlane[axis];
+        childID ^= 4u >> axis;
+        children[count++] = childID;
+      }
+    }
+    bounds[count] = tExit;
+
+    // push far to near, so the nearest child is popped first
+    for (size_t i = count; i-- > 0;) {
+      uint32_t child = children[i];
+      float3 offset{static_cast<float>(child >> 2),
+                    static_cast<float>((child >> 1) & 1u),
+                    static_cast<float>(child & 1u)};
+      stack[stackSize++] = {node + child,
+                            boxMin + offset * half, half, bounds[i],
+                            bounds[i + 1]};
     }
   }
 
   return result;
 }
 
+HitInfo SDFOctree::traverseRopes(const LiteMath::float3 &rayPos,
+                                 const LiteMath::float3 &rayDir, float tNear,
+                                 float tFar, float spread, bool anyHit,
+                                 uint64_t &visits) const {
+  HitInfo result;
+  float3 invDir = 1.0f / rayDir;
+  float coneSpread = spread * length(rayDir);
+  auto rootIntersection = BBox3f{float3{-1.0f}, float3{1.0f}}.Intersection(
+      rayPos, invDir, tNear, tFar);
+  if (rootIntersection.t1 > rootIntersection.t2) {
+    return result;
+  }
+
+  float t = rootIntersection.t1;
+  uint32_t nodeID = 0;
+  while (true) {
+    // descends from the entered node to the leaf holding the ray at t,
+    // points on a splitting plane go to the side the ray heads to
+    float3 boxMin = m_ropes[nodeID].boxMin;
+    float size = m_ropes[nodeID].size;
+    float3 point = rayPos + t * rayDir;
+    uint32_t node = m_topology[nodeID];
+    ++visits;
+    while ((node & OCTREE_LEAF_BIT) == 0 && size >= coneSpread * t) {
+      float half = size * 0.5f;
+      float3 center = boxMin + half;
+      uint32_t childID = 0;
+      for (int axis = 0; axis < 3; ++axis) {
+        if (point[axis] > center[axis] ||
+            (point[axis] == center[axis] && rayDir[axis] >= 0.0f)) {
+          childID |= 4u >> axis;
+          boxMin[axis] = center[axis];
+        }
+      }
+      nodeID = node + childID;
+      node = m_topology[nodeID];
+      size = half;
+      ++visits;
+    }
+
+    float corners[8];
+    BBox3f box{boxMin, boxMin + size};
+    if (nodeValues(node, corners) &&
+        hitNode(corners, box, rayPos, rayDir, tNear, tFar, anyHit, result)) {
+      return result;
+    }
+
+    // the ray leaves the node through the face it reaches first
+    float tExit = std::numeric_limits<float>::infinity();
+    int exitFace = 0;
+    for (int axis = 0; axis < 3; ++axis) {
+      if (rayDir[axis] == 0.0f) {
+        continue;
+      }
+      bool positive = rayDir[axis] > 0.0f;
+      float plane = positive ? box.boxMax[axis] : box.boxMin[axis];
+      float tPlane = (plane - rayPos[axis]) * invDir[axis];
+      if (tPlane < tExit) {
+        tExit = tPlane;
+        exitFace = 2 * axis + (positive ? 1 : 0);
+      }
+    }
+    nodeID = m_ropes[nodeID].neighbours[exitFace];
+    if (tExit >= tFar || nodeID == OCTREE_NO_NEIGHBOUR) {
+      return result;
+    }
+    t = std::max(t, tExit);
+  }
+}
+
 HitInfo SDFOctree::intersect(const LiteMath::float3 &rayPos,
                              const LiteMath::float3 &rayDir, float tNear,
                              float tFar) const {
-  return intersectNode(0, rayPos, rayDir, tNear, tFar);
-}
\ No newline at end of file
+  uint64_t visits = 0;
+  HitInfo result = traverse(rayPos, rayDir, tNear, tFar, 0.0f, false, visits);
+  if (countSteps) {
+    m_marchCounters.add(0, 1, visits);
+  }
+  return result;
+}
+
+bool SDFOctree::occluded(const LiteMath::float3 &rayPos,
+                         const LiteMath::float3 &rayDir, float tNear,
+                         float tFar) const {
+  uint64_t visits = 0;
+  bool hit = traverse(rayPos, rayDir, tNear, tFar, 0.0f, true, visits).hitten;
+  if (countSteps) {
+    m_marchCounters.add(0, 1, visits);
+  }
+  return hit;
+}
+
+void SDFOctree::intersect(std::span<const Ray> rays,
+                          std::span<HitInfo> hits) const {
+  uint64_t visits = 0;
+  for (size_t i = 0; i < rays.size(); ++i) {
+    hits[i] = traverse(rays[i].pos, rays[i].dir, rays[i].tNear, rays[i].tFar,
+                       rays[i].spread, false, visits);
+  }
+  if (countSteps) {
+    m_marchCounters.add(0, rays.size(), visits);
+  }
+}
+
+void SDFOctree::buildRopes() {
+  m_ropes.assign(m_topology.size(), NodeRopes{});
+  auto &rootRopes = m_ropes[0];
+  std::fill_n(rootRopes.neighbours, 6, OCTREE_NO_NEIGHBOUR);
+  rootRopes.boxMin = float3{-1.0f};
+  rootRopes.size = 2.0f;
+
+  // in breadth first order the boxes of a parent and of its neighbours are
+  // set before the parent is split, the neighbours are not deeper than it
+  for (uint32_t nodeID = 0; nodeID < m_topology.size(); ++nodeID) {
+    uint32_t node = m_topology[nodeID];
+    if ((node & OCTREE_LEAF_BIT) != 0) {
+      continue;
+    }
+    const NodeRopes &parent = m_ropes[nodeID];
+    float half = parent.size * 0.5f;
+    for (uint32_t childID = 0; childID < 8; ++childID) {
+      NodeRopes &ropes = m_ropes[node + childID];
+      float3 offset{static_cast<float>(childID >> 2),
+                    static_cast<float>((childID >> 1) & 1u),
+                    static_cast<float>(childID & 1u)};
+      ropes.boxMin = parent.boxMin + offset * half;
+      ropes.size = half;
+      float3 center = ropes.boxMin + half * 0.5f;
+      for (int axis = 0; axis < 3; ++axis) {
+        uint32_t bit = 4u >> axis;
+        int upper = (childID & bit) != 0 ? 1 : 0;
+        // the inner face is shared with a sibling
+        ropes.neighbours[2 * axis + 1 - upper] = node + (childID ^ bit);
+
+        // the outer face borders the neighbour of the parent, which is
+        // refined down to the size of the child
+        uint32_t neighbourID = parent.neighbours[2 * axis + upper];
+        if (neighbourID == OCTREE_NO_NEIGHBOUR) {
+          ropes.neighbours[2 * axis + upper] = OCTREE_NO_NEIGHBOUR;
+          continue;
+        }
+        float3 faceCenter = center;
+        faceCenter[axis] =
+            ropes.boxMin[axis] + static_cast<float>(upper) * half;
+        float3 neighbourMin = m_ropes[neighbourID].boxMin;
+        float neighbourSize = m_ropes[neighbourID].size;
+        uint32_t neighbour = m_topology[neighbourID];
+        while (neighbourSize > half && (neighbour & OCTREE_LEAF_BIT) == 0) {
+          neighbourSize *= 0.5f;
+          float3 neighbourCenter = neighbourMin + neighbourSize;
+          uint32_t neighbourChildID = 0;
+          for (int i = 0; i < 3; ++i) {
+            if (faceCenter[i] > neighbourCenter[i]) {
+              neighbourChildID |= 4u >> i;
+              neighbourMin[i] = neighbourCenter[i];
+            }
+          }
+          neighbourID = neighbour + neighbourChildID;
+          neighbour = m_topology[neighbourID];
+        }
+        ropes.neighbours[2 * axis + upper] = neighbourID;
+      }
+    }
+  }
+
+  std::cout << "SDF octree ropes: "
+            << static_cast<float>(m_ropes.size() * sizeof(NodeRopes)) /
+                   (1024.0f * 1024.0f)
+            << "MB" << std::endl;
+}
+
+float SDFOctree::minLeafSize() const {
+  float result = 2.0f;
+  std::vector<std::pair<uint32_t, float>> stack = {{0, 2.0f}};
+  while (!stack.empty()) {
+    auto [nodeID, nodeSize] = stack.back();
+    stack.pop_back();
+    uint32_t node = m_topology[nodeID];
+    if ((node & OCTREE_LEAF_BIT) != 0) {
+      if (node != OCTREE_EMPTY_LEAF) {
+        result = std::min(result, nodeSize);
+      }
+      continue;
+    }
+    for (uint32_t childID = 0; childID < 8; ++childID) {
+      stack.push_back({node + childID, nodeSize / 2.0f});
+    }
+  }
+  return result;
+}
+
+// 8 bit distances are truncated to a few smallest leaves
+constexpr float INT8_TRUNCATION_LEAVES = 8.0f;
+
+void SDFOctree::quantize(SDFStorage storage) {
+  if (storage == SDFStorage::Float32 || m_leafValues.empty()) {
+    return;
+  }
+
+  float maxValue = 0.0f;
+  for (float value : m_leafValues) {
+    if (std::abs(value) <= EMPTY_VALUE) {
+      maxValue = std::max(maxValue, std::abs(value));
+    }
+  }
+  float leafSize = minLeafSize();
+  float truncation = maxValue;
+  if (storage == SDFStorage::Int8) {
+    truncation = std::min(truncation, INT8_TRUNCATION_LEAVES * leafSize);
+  }
+
+  auto error = quantizeSDF(m_leafValues, storage, truncation, quantized);
+  float floatMB = static_cast<float>(m_leafValues.size() * sizeof(float)) /
+                  (1024.0f * 1024.0f);
+  float quantizedMB = static_cast<float>(quantized.bytes()) /
+                      (1024.0f * 1024.0f);
+  std::cout << "SDF octree values quantized to "
+            << (storage == SDFStorage::Int16 ? 16 : 8) << " bit: "
+            << quantizedMB << "MB instead of " << floatMB
+            << "MB, max error " << error.maxError / leafSize
+            << " leaves, mean error " << error.meanError / leafSize
+            << " leaves" << std::endl;
+
+  // leaves read the quantized values from now on
+  m_leafValues.clear();
+  m_leafValues.shrink_to_fit();
+}
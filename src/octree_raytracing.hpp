@@ -1,10 +1,16 @@
 #pragma once
 
 #include <cinttypes>
+#include <span>
+#include <string>
 #include <vector>
 
 #include "raytracing.hpp"
+#include "sdf_quantization.hpp"
+#include "sphere_tracing.hpp"
+#include "trilinear.hpp"
 
+// node of the .octree files
 struct SDFOctreeNode {
   float values[8];
   uint32_t childrenOffset = 0;
@@ -17,33 +23,131 @@ struct SDFOctreeNode {
   }
 };
 
+// Topology word of a node. Inner nodes keep the index of their first child,
+// leaves the index of their values with OCTREE_LEAF_BIT set, and leaves
+// without surface are OCTREE_EMPTY_LEAF and have no values.
+constexpr uint32_t OCTREE_LEAF_BIT = 1u << 31;
+constexpr uint32_t OCTREE_EMPTY_LEAF = ~0u;
+// rope of a face on the boundary of the octree
+constexpr uint32_t OCTREE_NO_NEIGHBOUR = ~0u;
+// deepest level the traversal stack holds, boxes this small are already
+// far below float precision
+constexpr uint32_t OCTREE_MAX_DEPTH = 42;
+
+enum class OctreeTraversal {
+  Stack, // front to back descent from the root with an explicit stack
+  // steps from a leaf into the neighbour across its exit face and descends
+  // only inside of it, needs SDFOctree::buildRopes
+  Ropes
+};
+
 struct SDFOctree final : public IScene {
 public:
   HitInfo intersect(const LiteMath::float3 &rayPos,
                     const LiteMath::float3 &rayDir, float tNear,
                     float tFar) const override;
+  void intersect(std::span<const Ray> rays,
+                 std::span<HitInfo> hits) const override;
+  bool occluded(const LiteMath::float3 &rayPos, const LiteMath::float3 &rayDir,
+                float tNear, float tFar) const override;
+  // converts nodes of the file layout into the split one, nodes are
+  // renumbered breadth first, so the children of the k-th inner node start
+  // at 8k+1; children have to follow their parent in fileNodes, throws
+  // std::runtime_error when a node has several parents or the tree is
+  // deeper than OCTREE_MAX_DEPTH
+  void setNodes(std::span<const SDFOctreeNode> fileNodes);
+  size_t nodesCount() const noexcept { return m_topology.size(); }
+  // leaves having values
+  size_t leavesCount() const noexcept { return m_leavesCount; }
+  // leaf values are read from the quantized storage unless it is Float32,
+  // float values are released then, inner values stay float
+  void quantize(SDFStorage storage);
+  // neighbour links of every node, used by OctreeTraversal::Ropes
+  void buildRopes();
+  bool hasRopes() const noexcept { return !m_ropes.empty(); }
+  const MarchCounters &marchCounters() const noexcept {
+    return m_marchCounters;
+  }
+  void resetMarchCounters() noexcept { m_marchCounters.reset(); }
 
 private:
-  HitInfo intersectNode(size_t nodeID, const LiteMath::float3 &rayPos,
-                        const LiteMath::float3 &rayDir, float tNear, float tFar,
-                        const LiteMath::BBox3f &nodeBox = {
-                            LiteMath::float3{-1.0f},
-                            LiteMath::float3{1.0f}}) const;
-
-  float nodeSDF(size_t nodeID, const LiteMath::BBox3f &nodeBox,
-                LiteMath::float3 point) const;
-  float nodeSDF(size_t nodeID, LiteMath::uint3 point) const {
-    return nodes[nodeID].values[(point.x << 2) + (point.y << 1) + point.z];
+  void leafValues(size_t leafID, float corners[8]) const noexcept {
+    if (quantized.storage == SDFStorage::Float32) [[likely]] {
+      std::copy_n(m_leafValues.begin() + static_cast<ptrdiff_t>(leafID * 8),
+                  8, corners);
+      return;
+    }
+    for (size_t i = 0; i < 8; ++i) {
+      corners[i] = quantized[leafID * 8 + i];
+    }
   }
-  LiteMath::float3 nodeNormal(size_t nodeID, const LiteMath::BBox3f &nodeBox,
-                              LiteMath::float3 point) const;
-  HitInfo intersectLeaf(size_t nodeID, const LiteMath::BBox3f &nodeBox,
+  // edge of the smallest leaf
+  float minLeafSize() const;
+  // visits the leaves along the ray front to back with an explicit stack,
+  // anyHit stops at the first hit closer than tFar. Inner nodes smaller than
+  // the ray cone of the given spread are marched as leaves.
+  HitInfo traverse(const LiteMath::float3 &rayPos,
+                   const LiteMath::float3 &rayDir, float tNear, float tFar,
+                   float spread, bool anyHit, uint64_t &visits) const;
+  HitInfo traverseRopes(const LiteMath::float3 &rayPos,
+                        const LiteMath::float3 &rayDir, float tNear,
+                        float tFar, float spread, bool anyHit,
+                        uint64_t &visits) const;
+  // values of a leaf or of an inner node below the pixel footprint, false
+  // when they can not be hit
+  bool nodeValues(uint32_t node, float corners[8]) const;
+  // marches the values of a node, true when the traversal is over
+  bool hitNode(const float corners[8], const LiteMath::BBox3f &box,
+               const LiteMath::float3 &rayPos, const LiteMath::float3 &rayDir,
+               float tNear, float tFar, bool anyHit, HitInfo &result) const;
+
+  static float leafSDF(const float corners[8], const LiteMath::BBox3f &leafBox,
+                       LiteMath::float3 point);
+  static LiteMath::float3 leafNormal(const float corners[8],
+                                     const LiteMath::BBox3f &leafBox,
+                                     LiteMath::float3 point);
+  bool marchLeaf(const float corners[8], const LiteMath::BBox3f &leafBox,
+                 const LiteMath::float3 &rayPos, const LiteMath::float3 &rayDir,
+                 float tNear, float tFar, float &tHit,
+                 LiteMath::float3 &hitPoint) const;
+  HitInfo intersectLeaf(const float corners[8], const LiteMath::BBox3f &leafBox,
                         const LiteMath::float3 &rayPos,
                         const LiteMath::float3 &rayDir, float tNear,
                         float tFar) const;
 
 public:
-  std::vector<SDFOctreeNode> nodes;
+  QuantizedSDF quantized;
+  // policy of the sphere tracing inside leaves
+  MarchPolicy marchPolicy = MarchPolicy::Plain;
+  float relaxation = 1.5f;
+  // leaf march steps, node visits and traced rays are counted only when
+  // enabled
+  bool countSteps = false;
+  // ropes are used only once they are built
+  OctreeTraversal traversal = OctreeTraversal::Stack;
+
+private:
+  // neighbours across the -x, +x, -y, +y, -z, +z faces are the smallest
+  // nodes covering the whole face that are not smaller than the node
+  struct NodeRopes {
+    uint32_t neighbours[6];
+    LiteMath::float3 boxMin;
+    float size;
+  };
+
+  std::vector<uint32_t> m_topology;
+  // 8 corner values per leaf
+  std::vector<float> m_leafValues;
+  // 8 corner values per inner node in breadth first order, they are
+  // sampled from the leaves at the corners and replace the subtree when it
+  // is smaller than the ray cone
+  std::vector<float> m_innerValues;
+  std::vector<NodeRopes> m_ropes;
+  size_t m_leavesCount = 0;
+  mutable MarchCounters m_marchCounters;
 };
 
-void loadSDFOctree(SDFOctree &scene, const std::string &path);
\ No newline at end of file
+// throws std::runtime_error on malformed files
+void loadSDFOctree(SDFOctree &scene, const std::string &path);
+void saveSDFOctree(std::span<const SDFOctreeNode> nodes,
+                   const std::string &path);
\ No newline at end of file
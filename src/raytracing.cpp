@@ -1,4 +1,5 @@
 #include "chrono"
+#include <omp.h>
 
 #include "raytracing.hpp"
 
@@ -15,6 +16,13 @@ Renderer::intersectionColor(const IScene &scene, const float3 &rayPos,
                             const float3 &rayDir, float tNear, float tFar,
                             float tPrev, int maxDepth) const {
   auto hit = scene.intersect(rayPos, rayDir, tNear, std::min(tFar, tPrev));
+  return hitColor(scene, hit, rayPos, rayDir, maxDepth);
+}
+
+std::pair<float4, float> Renderer::hitColor(const IScene &scene, HitInfo hit,
+                                            const float3 &rayPos,
+                                            const float3 &rayDir,
+                                            int maxDepth) const {
   if (!hit.hitten) {
     return {float4(0.0f, 0.0f, 0.0f, 1.0f),
             std::numeric_limits<float>::infinity()};
@@ -35,9 +43,8 @@ Renderer::intersectionColor(const IScene &scene, const float3 &rayPos,
     float3 point = rayPos + hit.t * rayDir;
     if (enableShadows) {
       float3 shadowDir = normalize(lightPos - point);
-      HitInfo shadowHit =
-          scene.intersect(point + 0.3f*shadowDir, shadowDir, 0.01f, 100.0f);
-      lightIsVisible = !shadowHit.hitten;
+      lightIsVisible =
+          !scene.occluded(point + 0.3f*shadowDir, shadowDir, 0.01f, 100.0f);
     }
     if (!lightIsVisible) {
       color = to_float4(hit.albedo * 0.1f, 1.0f);
@@ -64,9 +71,69 @@ Renderer::intersectionColor(const IScene &scene, const float3 &rayPos,
   return {color, hit.t};
 }
 
+static uint32_t mortonCode(uint32_t x, uint32_t y) {
+  uint32_t code = 0;
+  for (uint32_t bit = 0; bit < 16; ++bit) {
+    code |= ((x >> bit) & 1u) << (2 * bit);
+    code |= ((y >> bit) & 1u) << (2 * bit + 1);
+  }
+  return code;
+}
+
+// index on the Hilbert curve of order n (n is a power of 2) -> coordinates
+static int2 hilbertPoint(int n, int index) {
+  int2 p = {0, 0};
+  for (int s = 1; s < n; s *= 2) {
+    int rx = 1 & (index / 2);
+    int ry = 1 & (index ^ rx);
+    if (ry == 0) {
+      if (rx == 1) {
+        p.x = s - 1 - p.x;
+        p.y = s - 1 - p.y;
+      }
+      std::swap(p.x, p.y);
+    }
+    p.x += s * rx;
+    p.y += s * ry;
+    index /= 4;
+  }
+  return p;
+}
+
+static std::vector<int2> makeTiles(int tilesX, int tilesY, TileOrder order) {
+  std::vector<int2> tiles;
+  tiles.reserve(static_cast<size_t>(tilesX) * static_cast<size_t>(tilesY));
+  if (order == TileOrder::Hilbert) {
+    int n = 1;
+    while (n < tilesX || n < tilesY) {
+      n *= 2;
+    }
+    for (int index = 0; index < n * n; ++index) {
+      int2 tile = hilbertPoint(n, index);
+      if (tile.x < tilesX && tile.y < tilesY) {
+        tiles.push_back(tile);
+      }
+    }
+    return tiles;
+  }
+
+  for (int y = 0; y < tilesY; ++y) {
+    for (int x = 0; x < tilesX; ++x) {
+      tiles.push_back(int2{x, y});
+    }
+  }
+  if (order == TileOrder::Morton) {
+    std::sort(tiles.begin(), tiles.end(), [](int2 a, int2 b) {
+      return mortonCode(static_cast<uint32_t>(a.x), static_cast<uint32_t>(a.y)) <
+             mortonCode(static_cast<uint32_t>(b.x), static_cast<uint32_t>(b.y));
+    });
+  }
+  return tiles;
+}
+
 float Renderer::draw(const IScene &scene, FrameBuffer &frameBuffer,
                      const Camera &camera,
-                     const LiteMath::float4x4 projInv) const {
+                     const LiteMath::float4x4 projInv) {
   auto &[colorBuf, tBuf] = frameBuffer;
   int width = colorBuf.width();
   int height = colorBuf.height();
@@ -74,25 +141,100 @@ float Renderer::draw(const IScene &scene, FrameBuffer &frameBuffer,
   auto viewMatrix = camera.lookAtMatrix();
   auto viewInv = inverse4x4(viewMatrix);
   auto b = std::chrono::high_resolution_clock::now();
-#ifdef NDEBUG
-#pragma omp parallel for schedule(dynamic)
-#endif
-  for (int y = 0; y < height; ++y) {
-    for (int x = 0; x < width; ++x) {
-      int2 xy = {x, height - y - 1};
+
+  // angle between the central pixel and its neighbour, the view rotation
+  // does not change it
+  float pixelSpread = 0.0f;
+  if (enableRayCones) {
+    auto eyeDirection = [&](float x) {
+      return normalize(to_float3(EyeRayDir4f(
+          x, static_cast<float>(height / 2), static_cast<float>(width),
+          static_cast<float>(height), projInv)));
+    };
+    float x = static_cast<float>(width / 2);
+    pixelSpread = length(eyeDirection(x + 1.0f) - eyeDirection(x));
+  }
+
+  int curTileSize = std::max(tileSize, 1);
+  int tilesX = (width + curTileSize - 1) / curTileSize;
+  int tilesY = (height + curTileSize - 1) / curTileSize;
+  auto tiles = makeTiles(tilesX, tilesY, tileOrder);
+
+  auto threadsCount = static_cast<size_t>(omp_get_max_threads());
+  m_stats.tilesCount = static_cast<uint32_t>(tiles.size());
+  m_stats.threadTime.assign(threadsCount, 0.0f);
+  m_stats.threadTiles.assign(threadsCount, 0);
+
+  // one tile per chunk: idle threads keep grabbing tiles until the frame is
+  // done, so expensive tiles do not stall the end of the frame
+#pragma omp parallel for schedule(dynamic, 1)
+  for (size_t tileID = 0; tileID < tiles.size(); ++tileID) {
+    auto tileBegin = std::chrono::high_resolution_clock::now();
+    int2 tile = tiles[tileID];
+    int yEnd = std::min((tile.y + 1) * curTileSize, height);
+    int xEnd = std::min((tile.x + 1) * curTileSize, width);
+    auto rayDirection = [&](int x, int y) {
       float4 rayDir4 = EyeRayDir4f(
           static_cast<float>(x) + 0.5f, static_cast<float>(y) + 0.5f,
           static_cast<float>(width), static_cast<float>(height), projInv);
       rayDir4.w = 0.0f;
       rayDir4 = viewInv * rayDir4;
-      float3 rayDir = to_float3(rayDir4);
-      auto [color, tNew] =
-          intersectionColor(scene, rayPos, rayDir, 0.01f, 100.0f, tBuf[xy]);
+      return to_float3(rayDir4);
+    };
+    auto store = [&](int2 xy, std::pair<float4, float> colorT) {
+      auto [color, tNew] = colorT;
       if (!std::isinf(tNew)) {
         tBuf[xy] = tNew;
         colorBuf[xy] = color_pack_rgba(color);
       }
+    };
+
+    if (!enableRayStreams) {
+      for (int y = tile.y * curTileSize; y < yEnd; ++y) {
+        for (int x = tile.x * curTileSize; x < xEnd; ++x) {
+          int2 xy = {x, height - y - 1};
+          store(xy, intersectionColor(scene, rayPos, rayDirection(x, y), 0.01f,
+                                      100.0f, tBuf[xy]));
+        }
+      }
+    } else {
+      // rays are laid out in 4x2 pixel blocks to keep neighbours coherent,
+      // the buffers are kept per thread across tiles and frames
+      static thread_local std::vector<Ray> rays;
+      static thread_local std::vector<int2> pixels;
+      static thread_local std::vector<HitInfo> hits;
+      rays.clear();
+      pixels.clear();
+      for (int y0 = tile.y * curTileSize; y0 < yEnd; y0 += 2) {
+        for (int x0 = tile.x * curTileSize; x0 < xEnd; x0 += 4) {
+          for (int lane = 0; lane < 8; ++lane) {
+            int x = x0 + lane % 4;
+            int y = y0 + lane / 4;
+            if (x >= xEnd || y >= yEnd) {
+              continue;
+            }
+            int2 xy = {x, height - y - 1};
+            rays.push_back(Ray{rayPos, rayDirection(x, y), 0.01f,
+                               std::min(100.0f, tBuf[xy]), pixelSpread});
+            pixels.push_back(xy);
+          }
+        }
+      }
+
+      hits.assign(rays.size(), HitInfo{});
+      scene.intersect(rays, hits);
+      for (size_t i = 0; i < rays.size(); ++i) {
+        store(pixels[i], hitColor(scene, hits[i], rayPos, rays[i].dir));
+      }
     }
+    auto tileEnd = std::chrono::high_resolution_clock::now();
+    auto thread = static_cast<size_t>(omp_get_thread_num());
+    m_stats.threadTime[thread] +=
+        static_cast<float>(std::chrono::duration_cast<std::chrono::microseconds>(
+                               tileEnd - tileBegin)
+                               .count()) /
+        1e3f;
+    m_stats.threadTiles[thread]++;
   }
   auto e = std::chrono::high_resolution_clock::now();
   return static_cast<float>(
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <span>
+
 #include <LiteMath/Image2d.h>
 #include <LiteMath/LiteMath.h>
 
@@ -72,11 +74,28 @@ struct HitInfo {
   float reflectiveness = 0.0f;
 };
 
+struct Ray {
+  LiteMath::float3 pos;
+  LiteMath::float3 dir;
+  float tNear = 0.0f;
+  float tFar = std::numeric_limits<float>::infinity();
+  // width of the ray cone per unit of distance, scenes may skip details
+  // below it, 0 traces a thin ray
+  float spread = 0.0f;
+};
+
 class IScene {
 public:
   virtual HitInfo intersect(const LiteMath::float3 &rayPos,
                             const LiteMath::float3 &rayDir, float tNear,
                             float tFar) const = 0;
+  // any-hit query: true as soon as something is found in [tNear, tFar]
+  virtual bool occluded(const LiteMath::float3 &rayPos,
+                        const LiteMath::float3 &rayDir, float tNear,
+                        float tFar) const = 0;
+  // closest hits for a whole stream of rays, hits.size() == rays.size()
+  virtual void intersect(std::span<const Ray> rays,
+                         std::span<HitInfo> hits) const = 0;
   virtual ~IScene() {}
 };
 
@@ -91,12 +110,48 @@ public:
     HitInfo intersect2 = m_pSecond->intersect(rayPos, rayDir, tNear, tFar);
     return (intersect1.t < intersect2.t) ? intersect1 : intersect2;
   }
+  bool occluded(const LiteMath::float3 &rayPos, const LiteMath::float3 &rayDir,
+                float tNear, float tFar) const override {
+    return m_pFirst->occluded(rayPos, rayDir, tNear, tFar) ||
+           m_pSecond->occluded(rayPos, rayDir, tNear, tFar);
+  }
+  void intersect(std::span<const Ray> rays,
+                 std::span<HitInfo> hits) const override {
+    // per thread buffers, taken for the call so that nested unions get
+    // their own ones instead of overwriting them
+    static thread_local std::vector<Ray> scratchRays;
+    static thread_local std::vector<HitInfo> scratchHits;
+    std::vector<Ray> clipped = std::move(scratchRays);
+    std::vector<HitInfo> hits2 = std::move(scratchHits);
+
+    m_pFirst->intersect(rays, hits);
+    clipped.assign(rays.begin(), rays.end());
+    for (size_t i = 0; i < rays.size(); ++i) {
+      clipped[i].tFar = std::min(clipped[i].tFar, hits[i].t);
+    }
+    hits2.assign(rays.size(), HitInfo{});
+    m_pSecond->intersect(clipped, hits2);
+    for (size_t i = 0; i < rays.size(); ++i) {
+      if (hits2[i].t < hits[i].t) {
+        hits[i] = hits2[i];
+      }
+    }
+    scratchRays = std::move(clipped);
+    scratchHits = std::move(hits2);
+  }
 
 private:
   std::shared_ptr<IScene> m_pFirst, m_pSecond;
 };
 
 enum class ShadingMode { Normal, Lambert, Color };
+enum class TileOrder { Scanline, Morton, Hilbert };
+
+struct FrameStats {
+  uint32_t tilesCount = 0;
+  std::vector<float> threadTime; // ms spent in tiles, per worker thread
+  std::vector<uint32_t> threadTiles;
+};
 
 struct Renderer {
 public:
@@ -104,16 +159,28 @@ public:
   bool enableShadows = true;
   bool enableReflections = true;
   ShadingMode shadingMode = ShadingMode::Lambert;
+  int tileSize = 16;
+  TileOrder tileOrder = TileOrder::Morton;
+  bool enableRayStreams = true; // trace primary rays of a tile in bulk
+  // primary ray streams carry the cone of a pixel for level of detail
+  bool enableRayCones = false;
 
 public:
   float draw(const IScene &scene, FrameBuffer &frameBuffer,
-             const Camera &camera, const LiteMath::float4x4 projInv) const;
+             const Camera &camera, const LiteMath::float4x4 projInv);
+  const FrameStats &frameStats() const noexcept { return m_stats; }
+
+private:
+  FrameStats m_stats;
 
 private:
   std::pair<LiteMath::float4, float>
   intersectionColor(const IScene &scene, const LiteMath::float3 &rayPos,
                     const LiteMath::float3 &rayDir, float tNear, float tFar,
                     float tPrev, int maxDepth = 2) const;
+  std::pair<LiteMath::float4, float>
+  hitColor(const IScene &scene, HitInfo hit, const LiteMath::float3 &rayPos,
+           const LiteMath::float3 &rayDir, int maxDepth = 2) const;
 };
 
 class Plane final : public IScene {
@@ -164,6 +231,21 @@ public:
     result.reflectiveness = 0.3f;
     return result;
   }
+  bool occluded(const LiteMath::float3 &rayPos, const LiteMath::float3 &rayDir,
+                float tNear, float tFar) const override {
+    float dividor = LiteMath::dot(rayDir, m_normal);
+    if (std::abs(dividor) < 1e-8f) {
+      return false;
+    }
+    float t = (m_offset - dot(rayPos, m_normal)) / dividor;
+    return t >= tNear && t <= tFar;
+  }
+  void intersect(std::span<const Ray> rays,
+                 std::span<HitInfo> hits) const override {
+    for (size_t i = 0; i < rays.size(); ++i) {
+      hits[i] = intersect(rays[i].pos, rays[i].dir, rays[i].tNear, rays[i].tFar);
+    }
+  }
 
 private:
   void recalcBasis() {
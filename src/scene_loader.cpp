@@ -0,0 +1,23 @@
+#include "scene_loader.hpp"
+#include "raytracing.hpp"
+
+using namespace LiteMath;
+
+cmesh4::SimpleMesh loadAndScale(std::filesystem::path path) {
+  auto mesh = cmesh4::LoadMeshFromObj(path.c_str(), true);
+
+  auto bbox = calc_bbox(mesh);
+  auto center = (bbox.boxMin + bbox.boxMax) / 2.0f;
+  auto scale = length(bbox.boxMax - center);
+  for (auto &v : mesh.vPos4f) {
+    auto w = v.w;
+    v /= w;
+    float3 scaled = to_float3(v);
+    scaled -= center;
+    scaled /= scale;
+    v = to_float4(scaled, 1.0f);
+    v *= w;
+  }
+
+  return mesh;
+}
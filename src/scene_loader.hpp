@@ -0,0 +1,8 @@
+#pragma once
+
+#include <filesystem>
+
+#include "mesh.h"
+
+// loads an .obj and fits it into the [-1, 1] cube
+cmesh4::SimpleMesh loadAndScale(std::filesystem::path path);
@@ -0,0 +1,292 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include "sdf_baker.hpp"
+
+using namespace LiteMath;
+
+// crossings closer than this along a line are the same crossing of a shared
+// edge or vertex
+constexpr float CROSSING_EPS = 1e-5f;
+// line rays start outside of the [-1, 1] cube
+constexpr float LINE_START = -2.0f;
+// lines are shifted by a fraction of a step, so that they do not run along
+// mesh edges lying on grid planes
+constexpr float LINE_SHIFT = 1e-3f;
+
+// crossings are found one by one, each search starts past the last one
+static void findCrossings(const BVHBuilder &bvh, const float3 &rayPos,
+                          const float3 &rayDir, float tFar,
+                          std::vector<float> &crossings) {
+  float tNear = 0.0f;
+  while (true) {
+    HitInfo hit = bvh.intersect(rayPos, rayDir, tNear, tFar);
+    if (!hit.hitten) {
+      break;
+    }
+    crossings.push_back(hit.t);
+    tNear = hit.t + CROSSING_EPS;
+  }
+}
+
+// marks samples of every line along axis with an odd number of crossings
+// before them
+static void voteInside(const BVHBuilder &bvh, uint32_t resolution, int axis,
+                       std::vector<uint8_t> &insideVotes) {
+  float step = 2.0f / static_cast<float>(resolution - 1);
+  // u and v are the two other axes
+  int u = (axis + 1) % 3;
+  int v = (axis + 2) % 3;
+  int linesCount = static_cast<int>(resolution * resolution);
+
+#pragma omp parallel for schedule(dynamic, 64)
+  for (int lineID = 0; lineID < linesCount; ++lineID) {
+    uint32_t coords[3] = {};
+    coords[u] = static_cast<uint32_t>(lineID) / resolution;
+    coords[v] = static_cast<uint32_t>(lineID) % resolution;
+
+    float3 rayPos;
+    rayPos[u] = -1.0f + (static_cast<float>(coords[u]) + LINE_SHIFT) * step;
+    rayPos[v] =
+        -1.0f + (static_cast<float>(coords[v]) + 2.0f * LINE_SHIFT) * step;
+    rayPos[axis] = LINE_START;
+    float3 rayDir{0.0f};
+    rayDir[axis] = 1.0f;
+
+    std::vector<float> crossings;
+    findCrossings(bvh, rayPos, rayDir, 2.0f - LINE_START, crossings);
+
+    size_t crossingID = 0;
+    for (uint32_t i = 0; i < resolution; ++i) {
+      float t = -1.0f + static_cast<float>(i) * step - LINE_START;
+      while (crossingID < crossings.size() && crossings[crossingID] < t) {
+        ++crossingID;
+      }
+      coords[axis] = i;
+      if (crossingID % 2 == 1) {
+        size_t index =
+            (static_cast<size_t>(coords[0]) * resolution + coords[1]) *
+                resolution +
+            coords[2];
+        ++insideVotes[index];
+      }
+    }
+  }
+}
+
+void bakeSDFGrid(const BVHBuilder &bvh, uint32_t resolution, SDFGrid &grid) {
+  auto b = std::chrono::high_resolution_clock::now();
+
+  size_t samplesCount =
+      static_cast<size_t>(resolution) * resolution * resolution;
+  std::vector<uint8_t> insideVotes(samplesCount, 0);
+  for (int axis = 0; axis < 3; ++axis) {
+    voteInside(bvh, resolution, axis, insideVotes);
+  }
+
+  float step = 2.0f / static_cast<float>(resolution - 1);
+  std::vector<float> values(samplesCount);
+  int columnsCount = static_cast<int>(resolution * resolution);
+
+#pragma omp parallel for schedule(dynamic, 16)
+  for (int columnID = 0; columnID < columnsCount; ++columnID) {
+    uint32_t x = static_cast<uint32_t>(columnID) / resolution;
+    uint32_t y = static_cast<uint32_t>(columnID) % resolution;
+    size_t offset = static_cast<size_t>(columnID) * resolution;
+
+    // the closest point of the previous sample is a surface point, so its
+    // distance bounds the search of the next sample
+    float3 previous{std::numeric_limits<float>::infinity()};
+    for (uint32_t z = 0; z < resolution; ++z) {
+      float3 point{-1.0f + static_cast<float>(x) * step,
+                   -1.0f + static_cast<float>(y) * step,
+                   -1.0f + static_cast<float>(z) * step};
+      float bound = length(previous - point) * 1.001f;
+      ClosestPoint closest = bvh.closestPoint(point, bound);
+      if (closest.distance == std::numeric_limits<float>::infinity()) {
+        // only rounding can push the distance past the bound
+        closest = bvh.closestPoint(point);
+      }
+      previous = closest.point;
+      values[offset + z] =
+          insideVotes[offset + z] >= 2 ? -closest.distance : closest.distance;
+    }
+  }
+
+  grid.setValues(uint3{resolution, resolution, resolution}, std::move(values));
+  grid.buildPyramid();
+
+  auto e = std::chrono::high_resolution_clock::now();
+  std::cout << "SDF grid " << resolution << "^3 baked in "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(e - b)
+                   .count()
+            << " ms" << std::endl;
+}
+
+// single point rays are shifted off the lattice planes by this distance
+constexpr float POINT_SHIFT = 1e-5f;
+// subtrees above this depth are built as separate tasks
+constexpr uint32_t OCTREE_TASK_DEPTH = 4;
+
+// inside when the rays along at least two axes cross the surface an odd
+// number of times
+static bool isInside(const BVHBuilder &bvh, const float3 &point) {
+  std::vector<float> crossings;
+  int votes = 0;
+  for (int axis = 0; axis < 3; ++axis) {
+    float3 rayPos = point;
+    rayPos[(axis + 1) % 3] += POINT_SHIFT;
+    rayPos[(axis + 2) % 3] += 2.0f * POINT_SHIFT;
+    float3 rayDir{0.0f};
+    rayDir[axis] = 1.0f;
+    crossings.clear();
+    findCrossings(bvh, rayPos, rayDir, 2.0f - LINE_START, crossings);
+    votes += static_cast<int>(crossings.size() % 2);
+    // the first two axes decide when they agree
+    if (axis == 1 && votes != 1) {
+      break;
+    }
+  }
+  return votes >= 2;
+}
+
+static float signedDistance(const BVHBuilder &bvh, const float3 &point,
+                            float bound) {
+  ClosestPoint closest = bvh.closestPoint(point, bound * 1.001f);
+  if (closest.distance == std::numeric_limits<float>::infinity()) {
+    closest = bvh.closestPoint(point);
+  }
+  return isInside(bvh, point) ? -closest.distance : closest.distance;
+}
+
+namespace {
+
+// pointer based node, subtrees are filled by independent tasks and
+// flattened afterwards
+struct OctreeBuildNode {
+  float values[8];
+  std::unique_ptr<OctreeBuildNode[]> children;
+};
+
+struct OctreeBaker {
+  const BVHBuilder &bvh;
+  uint32_t maxDepth;
+
+  // values of the node are set by its parent
+  void build(OctreeBuildNode *pNode, float3 boxMin, float size,
+             uint32_t depth) const {
+    if (depth == maxDepth) {
+      return;
+    }
+    float half = 0.5f * size;
+    const float *corners = pNode->values;
+    // distances of neighbouring points differ by at most the distance
+    // between the points, so the corners bound the closest point searches
+    auto cornersBound = [&](const float3 &point) {
+      float bound = std::numeric_limits<float>::infinity();
+      for (uint32_t i = 0; i < 8; ++i) {
+        float3 corner = boxMin + float3{static_cast<float>(i >> 2),
+                                        static_cast<float>((i >> 1) & 1),
+                                        static_cast<float>(i & 1)} *
+                                     size;
+        bound = std::min(bound, std::abs(corners[i]) + length(point - corner));
+      }
+      return bound;
+    };
+
+    // the surface can pass through the node only when it is closer to the
+    // center than half of the diagonal
+    float3 center = boxMin + half;
+    float centerValue = signedDistance(bvh, center, cornersBound(center));
+    if (std::abs(centerValue) > half * std::sqrt(3.0f)) {
+      return;
+    }
+
+    // 3x3x3 lattice of the children corners
+    float lattice[27];
+    for (uint32_t x = 0; x < 3; ++x) {
+      for (uint32_t y = 0; y < 3; ++y) {
+        for (uint32_t z = 0; z < 3; ++z) {
+          uint32_t index = (x * 3 + y) * 3 + z;
+          if (x != 1 && y != 1 && z != 1) {
+            lattice[index] = corners[((x / 2) << 2) | ((y / 2) << 1) | (z / 2)];
+          } else if (x == 1 && y == 1 && z == 1) {
+            lattice[index] = centerValue;
+          } else {
+            float3 point = boxMin + float3{static_cast<float>(x),
+                                           static_cast<float>(y),
+                                           static_cast<float>(z)} *
+                                        half;
+            lattice[index] = signedDistance(bvh, point, cornersBound(point));
+          }
+        }
+      }
+    }
+
+    pNode->children = std::make_unique<OctreeBuildNode[]>(8);
+    for (uint32_t childID = 0; childID < 8; ++childID) {
+      uint32_t cx = childID >> 2;
+      uint32_t cy = (childID >> 1) & 1;
+      uint32_t cz = childID & 1;
+      OctreeBuildNode *pChild = &pNode->children[childID];
+      for (uint32_t i = 0; i < 8; ++i) {
+        pChild->values[i] = lattice[((cx + (i >> 2)) * 3 + cy +
+                                     ((i >> 1) & 1)) *
+                                        3 +
+                                    cz + (i & 1)];
+      }
+      float3 childMin =
+          boxMin + float3{static_cast<float>(cx), static_cast<float>(cy),
+                          static_cast<float>(cz)} *
+                       half;
+#pragma omp task if (depth < OCTREE_TASK_DEPTH)
+      build(pChild, childMin, half, depth + 1);
+    }
+  }
+};
+
+} // namespace
+
+void bakeSDFOctree(const BVHBuilder &bvh, uint32_t maxDepth,
+                   std::vector<SDFOctreeNode> &nodes) {
+  auto b = std::chrono::high_resolution_clock::now();
+
+  OctreeBuildNode root;
+  for (uint32_t i = 0; i < 8; ++i) {
+    float3 corner{i >> 2 ? 1.0f : -1.0f, (i >> 1) & 1 ? 1.0f : -1.0f,
+                  i & 1 ? 1.0f : -1.0f};
+    root.values[i] = signedDistance(bvh, corner,
+                                    std::numeric_limits<float>::infinity());
+  }
+  OctreeBaker baker{bvh, maxDepth};
+#pragma omp parallel
+#pragma omp single
+  baker.build(&root, float3{-1.0f}, 2.0f, 0);
+
+  // breadth first, so that the children of every node are contiguous
+  std::vector<const OctreeBuildNode *> order = {&root};
+  nodes.clear();
+  for (size_t nodeID = 0; nodeID < order.size(); ++nodeID) {
+    const OctreeBuildNode *pNode = order[nodeID];
+    SDFOctreeNode node;
+    std::copy_n(pNode->values, 8, node.values);
+    if (pNode->children) {
+      node.childrenOffset = static_cast<uint32_t>(order.size());
+      for (uint32_t childID = 0; childID < 8; ++childID) {
+        order.push_back(&pNode->children[childID]);
+      }
+    }
+    nodes.push_back(node);
+  }
+
+  auto e = std::chrono::high_resolution_clock::now();
+  std::cout << "SDF octree of depth " << maxDepth << " baked in "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(e - b)
+                   .count()
+            << " ms, " << nodes.size() << " nodes" << std::endl;
+}
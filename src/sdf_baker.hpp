@@ -0,0 +1,23 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "grid_raytracing.hpp"
+#include "octree_raytracing.hpp"
+#include "triangles_raytracing.hpp"
+
+// Bakes the signed distance to the mesh of bvh into a resolution^3 grid
+// covering the [-1, 1] cube. Distances come from closest point queries,
+// signs from the parity of surface crossings along axis aligned lines, the
+// majority of the three axes wins so that holes and grazing hits do not
+// flip the sign of whole lines. The bvh has to use the full node layout.
+void bakeSDFGrid(const BVHBuilder &bvh, uint32_t resolution, SDFGrid &grid);
+
+// Bakes the signed distance to the mesh of bvh into an octree over the
+// [-1, 1] cube. Nodes are split only when the surface can pass through them,
+// i.e. their center is closer to it than half of the diagonal, until
+// maxDepth. Every node keeps its corner distances, signs come from the
+// crossing parities of the three axis rays of each corner.
+void bakeSDFOctree(const BVHBuilder &bvh, uint32_t maxDepth,
+                   std::vector<SDFOctreeNode> &nodes);
@@ -0,0 +1,48 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "sdf_quantization.hpp"
+
+template <typename T>
+static QuantizationError quantizeTo(std::span<const float> values,
+                                    float truncation, float scale,
+                                    std::vector<T> &result) {
+  constexpr auto MAX_CODE = static_cast<float>(std::numeric_limits<T>::max());
+  QuantizationError error;
+  double errorSum = 0.0;
+  size_t counted = 0;
+  result.resize(values.size());
+  for (size_t i = 0; i < values.size(); ++i) {
+    float code = std::round(std::clamp(values[i] / scale, -MAX_CODE, MAX_CODE));
+    result[i] = static_cast<T>(code);
+    if (std::abs(values[i]) <= truncation) {
+      float cur = std::abs(code * scale - values[i]);
+      error.maxError = std::max(error.maxError, cur);
+      errorSum += cur;
+      ++counted;
+    }
+  }
+  if (counted > 0) {
+    error.meanError = static_cast<float>(errorSum / static_cast<double>(counted));
+  }
+  return error;
+}
+
+QuantizationError quantizeSDF(std::span<const float> values,
+                              SDFStorage storage, float truncation,
+                              QuantizedSDF &result) {
+  result = QuantizedSDF{};
+  result.storage = storage;
+  // an all zero SDF would give a zero scale and NaN codes
+  truncation = std::max(truncation, std::numeric_limits<float>::epsilon());
+  if (storage == SDFStorage::Int16) {
+    result.scale = truncation / static_cast<float>(std::numeric_limits<int16_t>::max());
+    return quantizeTo(values, truncation, result.scale, result.values16);
+  }
+  if (storage == SDFStorage::Int8) {
+    result.scale = truncation / static_cast<float>(std::numeric_limits<int8_t>::max());
+    return quantizeTo(values, truncation, result.scale, result.values8);
+  }
+  return {};
+}
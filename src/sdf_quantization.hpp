@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+enum class SDFStorage { Float32, Int16, Int8 };
+
+// Distances stored as round(value / scale) in signed normalized integers.
+// Values beyond the truncation distance are clamped, which keeps sphere
+// tracing conservative far from the surface.
+struct QuantizedSDF {
+  SDFStorage storage = SDFStorage::Float32;
+  float scale = 1.0f;
+  std::vector<int16_t> values16;
+  std::vector<int8_t> values8;
+
+  float operator[](size_t index) const noexcept {
+    if (storage == SDFStorage::Int16) {
+      return static_cast<float>(values16[index]) * scale;
+    }
+    return static_cast<float>(values8[index]) * scale;
+  }
+  size_t bytes() const noexcept {
+    return values16.size() * sizeof(int16_t) + values8.size() * sizeof(int8_t);
+  }
+};
+
+struct QuantizationError {
+  float maxError = 0.0f; // largest error of values below the truncation
+  float meanError = 0.0f;
+};
+
+QuantizationError quantizeSDF(std::span<const float> values,
+                              SDFStorage storage, float truncation,
+                              QuantizedSDF &result);
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+
+enum class MarchPolicy {
+  Plain, // steps by the distance
+  // steps by relaxation * distance and falls back to a plain step once the
+  // unbounding spheres of two samples stop overlapping
+  OverRelaxed
+};
+
+// march statistics shared by all threads
+class MarchCounters {
+public:
+  // visits are counted by hierarchies, e.g. octree nodes
+  void add(uint64_t steps, uint64_t rays, uint64_t visits = 0) noexcept {
+    m_steps.fetch_add(steps, std::memory_order_relaxed);
+    m_rays.fetch_add(rays, std::memory_order_relaxed);
+    m_visits.fetch_add(visits, std::memory_order_relaxed);
+  }
+  uint64_t steps() const noexcept {
+    return m_steps.load(std::memory_order_relaxed);
+  }
+  uint64_t rays() const noexcept {
+    return m_rays.load(std::memory_order_relaxed);
+  }
+  uint64_t visits() const noexcept {
+    return m_visits.load(std::memory_order_relaxed);
+  }
+  float stepsPerRay() const noexcept {
+    uint64_t raysCount = rays();
+    return raysCount == 0 ? 0.0f
+                          : static_cast<float>(steps()) /
+                                static_cast<float>(raysCount);
+  }
+  float visitsPerRay() const noexcept {
+    uint64_t raysCount = rays();
+    return raysCount == 0 ? 0.0f
+                          : static_cast<float>(visits()) /
+                                static_cast<float>(raysCount);
+  }
+  void reset() noexcept {
+    m_steps.store(0, std::memory_order_relaxed);
+    m_rays.store(0, std::memory_order_relaxed);
+    m_visits.store(0, std::memory_order_relaxed);
+  }
+
+private:
+  std::atomic<uint64_t> m_steps = 0;
+  std::atomic<uint64_t> m_rays = 0;
+  std::atomic<uint64_t> m_visits = 0;
+};
+
+// Advances a sphere traced ray. Over-relaxed steps are checked against the
+// previous sample, the part of the ray between two samples is safe only if
+// their unbounding spheres overlap.
+class SphereStepper {
+public:
+  SphereStepper(MarchPolicy policy, float relaxation, float t) noexcept
+      : m_relaxation(policy == MarchPolicy::OverRelaxed ? relaxation : 1.0f),
+        m_prevT(t) {}
+
+  // returns false if the sphere of radius |distance| around t misses the
+  // previous one, t is then moved back to the end of the previous plain step
+  // and relaxation stays off for the rest of the ray
+  bool verify(float &t, float distance) noexcept {
+    if (m_relaxation > 1.0f &&
+        std::abs(distance) + m_prevDistance < t - m_prevT) {
+      t = m_prevT + m_prevDistance;
+      m_relaxation = 1.0f;
+      return false;
+    }
+    return true;
+  }
+  // returns the position of the next sample
+  float advance(float t, float distance) noexcept {
+    m_prevT = t;
+    m_prevDistance = distance;
+    return t + m_relaxation * distance;
+  }
+  // skipped space is known to be empty, so there is no sphere to overlap
+  void restart(float t) noexcept {
+    m_prevT = t;
+    m_prevDistance = std::numeric_limits<float>::infinity();
+  }
+
+private:
+  float m_relaxation;
+  float m_prevT;
+  float m_prevDistance = std::numeric_limits<float>::infinity();
+};
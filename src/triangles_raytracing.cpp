@@ -1,7 +1,12 @@
-#include <execution>
+#include <algorithm>
+#include <bit>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 #include <chrono>
 #include <omp.h>
 #include <random>
+#include <stdexcept>
 
 #include "triangles_raytracing.hpp"
 #include <ray_pack_ispc.h>
@@ -32,17 +37,17 @@ BVHBuilder::DivisionResult BVHBuilder::tryDivide(std::vector<uint32_t> &indices,
                                                  uint32_t axes) {
   switch (axes) {
   case 0:
-    std::sort(std::execution::par_unseq, reinterpret_cast<Triple *>(indices.data() + start),
+    std::sort(reinterpret_cast<Triple *>(indices.data() + start),
               reinterpret_cast<Triple *>(indices.data() + end),
               makeComp<0>(m_mesh));
     break;
   case 1:
-    std::sort(std::execution::par_unseq, reinterpret_cast<Triple *>(indices.data() + start),
+    std::sort(reinterpret_cast<Triple *>(indices.data() + start),
               reinterpret_cast<Triple *>(indices.data() + end),
               makeComp<1>(m_mesh));
     break;
   case 2:
-    std::sort(std::execution::par_unseq, reinterpret_cast<Triple *>(indices.data() + start),
+    std::sort(reinterpret_cast<Triple *>(indices.data() + start),
               reinterpret_cast<Triple *>(indices.data() + end),
               makeComp<2>(m_mesh));
     break;
@@ -152,6 +157,116 @@ BVHBuilder::DivisionResult BVHBuilder::tryDivide(size_t start, size_t end) {
   return DivisionResult{};
 }
 
+constexpr size_t SAH_BINS_COUNT = 32;
+
+static float3 centroid(const cmesh4::SimpleMesh &mesh, const Triple &triangle) {
+  float4 v0 = mesh.vPos4f[triangle.indices[0]];
+  float4 v1 = mesh.vPos4f[triangle.indices[1]];
+  float4 v2 = mesh.vPos4f[triangle.indices[2]];
+  return (to_float3(v0 / v0.w) + to_float3(v1 / v1.w) + to_float3(v2 / v2.w)) /
+         3.0f;
+}
+
+static BBox3f emptyBox() {
+  BBox3f box;
+  box.boxMin = float3{std::numeric_limits<float>::infinity()};
+  box.boxMax = -box.boxMin;
+  return box;
+}
+
+static BBox3f merge(const BBox3f &box1, const BBox3f &box2) {
+  return BBox3f{min(box1.boxMin, box2.boxMin), max(box1.boxMax, box2.boxMax)};
+}
+
+BVHBuilder::DivisionResult BVHBuilder::tryDivideBinned(size_t start,
+                                                       size_t end) {
+  if (end - start <= 8 * 3) {
+    return DivisionResult{};
+  }
+
+  auto triangles = reinterpret_cast<Triple *>(m_mesh.indices.data());
+  size_t first = start / 3;
+  size_t last = end / 3;
+
+  BBox3f centroidBox = emptyBox();
+  for (size_t trID = first; trID < last; ++trID) {
+    float3 c = centroid(m_mesh, triangles[trID]);
+    centroidBox.boxMin = min(centroidBox.boxMin, c);
+    centroidBox.boxMax = max(centroidBox.boxMax, c);
+  }
+
+  auto binIndex = [&](const Triple &triangle, int axis) {
+    float extent = centroidBox.boxMax[axis] - centroidBox.boxMin[axis];
+    float c = centroid(m_mesh, triangle)[axis];
+    auto bin = static_cast<size_t>((c - centroidBox.boxMin[axis]) / extent *
+                                   static_cast<float>(SAH_BINS_COUNT));
+    return std::min(bin, SAH_BINS_COUNT - 1);
+  };
+
+  DivisionResult result;
+  result.sah = static_cast<float>(end - start) / 3.0f;
+  float parentSurfaceArea = surfaceArea(calc_bbox(m_mesh, start, end));
+  int bestAxis = -1;
+  size_t bestSplit = 0;
+
+  for (int axis = 0; axis < 3; ++axis) {
+    if (centroidBox.boxMax[axis] - centroidBox.boxMin[axis] <= 0.0f) {
+      continue;
+    }
+
+    BBox3f binBoxes[SAH_BINS_COUNT];
+    size_t binCounts[SAH_BINS_COUNT] = {};
+    std::fill(binBoxes, binBoxes + SAH_BINS_COUNT, emptyBox());
+    for (size_t trID = first; trID < last; ++trID) {
+      size_t bin = binIndex(triangles[trID], axis);
+      binBoxes[bin] = merge(binBoxes[bin], calc_bbox(m_mesh, triangles[trID].indices));
+      binCounts[bin]++;
+    }
+
+    // rightBoxes[split] bounds bins [split, SAH_BINS_COUNT)
+    BBox3f rightBoxes[SAH_BINS_COUNT];
+    size_t rightCounts[SAH_BINS_COUNT] = {};
+    rightBoxes[SAH_BINS_COUNT - 1] = binBoxes[SAH_BINS_COUNT - 1];
+    rightCounts[SAH_BINS_COUNT - 1] = binCounts[SAH_BINS_COUNT - 1];
+    for (size_t bin = SAH_BINS_COUNT - 1; bin-- > 0;) {
+      rightBoxes[bin] = merge(rightBoxes[bin + 1], binBoxes[bin]);
+      rightCounts[bin] = rightCounts[bin + 1] + binCounts[bin];
+    }
+
+    BBox3f leftBox = emptyBox();
+    size_t leftCount = 0;
+    for (size_t split = 1; split < SAH_BINS_COUNT; ++split) {
+      leftBox = merge(leftBox, binBoxes[split - 1]);
+      leftCount += binCounts[split - 1];
+      if (leftCount == 0 || rightCounts[split] == 0) {
+        continue;
+      }
+      float curSAH = EMPTY_NODE_TRAVERSE_COST +
+                     surfaceArea(leftBox) / parentSurfaceArea *
+                         static_cast<float>(leftCount) +
+                     surfaceArea(rightBoxes[split]) / parentSurfaceArea *
+                         static_cast<float>(rightCounts[split]);
+      if (curSAH < result.sah) {
+        result.sah = curSAH;
+        result.dividerId = start + leftCount * 3;
+        bestAxis = axis;
+        bestSplit = split;
+      }
+    }
+  }
+
+  if (bestAxis < 0) {
+    return DivisionResult{};
+  }
+
+  std::partition(triangles + first, triangles + last,
+                 [&](const Triple &triangle) {
+                   return binIndex(triangle, bestAxis) < bestSplit;
+                 });
+  result.isDivided = true;
+  return result;
+}
+
 void BVHBuilder::createNode(size_t offset, size_t start, size_t end) {
   BVH8Node node;
 
@@ -164,7 +279,9 @@ void BVHBuilder::createNode(size_t offset, size_t start, size_t end) {
     if (dividorsCount == 7) {
       break;
     }
-    auto result = tryDivide(curStart, curEnd);
+    auto result = (buildMode == BVHBuildMode::BinnedSAH)
+                      ? tryDivideBinned(curStart, curEnd)
+                      : tryDivide(curStart, curEnd);
     if (result.isDivided) {
       dividors[dividorsCount++] = result.dividerId;
       candidates.tryEnqueue({curStart, result.dividerId});
@@ -224,14 +341,55 @@ void BVHBuilder::createNode(size_t offset, size_t start, size_t end) {
   }
 }
 
+static TriangleLeaf8 makeLeafBlock(const cmesh4::SimpleMesh &mesh,
+                                   const BVHLeafInfo &leafInfo) {
+  uint32_t start = leafInfo.startIndex;
+  uint32_t end = start + leafInfo.count;
+  uint32_t trianglesCount = (end - start) / 3;
+  assert(trianglesCount <= 8);
+  trianglesCount = std::min(trianglesCount, 8u);
+
+  TriangleLeaf8 block = {};
+  for (uint32_t trID = 0; trID < trianglesCount; ++trID) {
+    float4 v0 = mesh.vPos4f[mesh.indices[start + trID * 3]];
+    float4 v1 = mesh.vPos4f[mesh.indices[start + trID * 3 + 1]];
+    float4 v2 = mesh.vPos4f[mesh.indices[start + trID * 3 + 2]];
+    float3 p0 = to_float3(v0 / v0.w);
+    float3 e1 = to_float3(v1 / v1.w) - p0;
+    float3 e2 = to_float3(v2 / v2.w) - p0;
+    float3 normal = normalize(cross(e1, e2));
+
+    block.v0.x[trID] = p0.x;
+    block.v0.y[trID] = p0.y;
+    block.v0.z[trID] = p0.z;
+    block.e1.x[trID] = e1.x;
+    block.e1.y[trID] = e1.y;
+    block.e1.z[trID] = e1.z;
+    block.e2.x[trID] = e2.x;
+    block.e2.y[trID] = e2.y;
+    block.e2.z[trID] = e2.z;
+    block.normal.x[trID] = normal.x;
+    block.normal.y[trID] = normal.y;
+    block.normal.z[trID] = normal.z;
+  }
+  return block;
+}
+
 void BVHBuilder::perform(cmesh4::SimpleMesh mesh) {
+  build(std::move(mesh));
+  applyNodeLayout();
+}
+
+void BVHBuilder::build(cmesh4::SimpleMesh mesh) {
   auto b = std::chrono::high_resolution_clock::now();
   m_mesh = std::move(mesh);
 
-  m_leftBoxes.resize(m_mesh.TrianglesNum());
-  m_rightBoxes.resize(m_mesh.TrianglesNum());
-  m_indicesY.resize(m_mesh.IndicesNum());
-  m_indicesZ.resize(m_mesh.IndicesNum());
+  if (buildMode == BVHBuildMode::SortedSAH) {
+    m_leftBoxes.resize(m_mesh.TrianglesNum());
+    m_rightBoxes.resize(m_mesh.TrianglesNum());
+    m_indicesY.resize(m_mesh.IndicesNum());
+    m_indicesZ.resize(m_mesh.IndicesNum());
+  }
 
   m_nodes = {BVH8Node{}};
   m_nodes.reserve(m_mesh.TrianglesNum() * 2);
@@ -252,84 +410,836 @@ void BVHBuilder::perform(cmesh4::SimpleMesh mesh) {
   m_rightBoxes.shrink_to_fit();
   m_indicesY.shrink_to_fit();
   m_indicesZ.shrink_to_fit();
+
+  m_leafBlocks.clear();
+  for (auto &node : m_nodes) {
+    if (node.isLeaf) {
+      node.leafInfo.blockIndex = static_cast<uint32_t>(m_leafBlocks.size());
+      m_leafBlocks.push_back(makeLeafBlock(m_mesh, node.leafInfo));
+    }
+  }
+  m_leafBlocks.shrink_to_fit();
+  m_cacheFile.close();
+  m_nodesView = m_nodes;
+  m_leafBlocksView = m_leafBlocks;
+
   auto e = std::chrono::high_resolution_clock::now();
   float t = static_cast<float>(std::chrono::duration_cast<std::chrono::microseconds>(e-b).count())/1e3f;
-  std::cout << "BVH construction: " << t << "ms" << std::endl;
+  std::cout << "BVH construction ("
+            << (buildMode == BVHBuildMode::BinnedSAH ? "binned" : "sorted")
+            << " SAH): " << t << "ms" << std::endl;
+  std::cout << "BVH nodes: " << m_nodes.size() << ", SAH cost: " << sahCost()
+            << std::endl;
+  std::cout << "BVH leaf blocks: " << m_leafBlocks.size() << " ("
+            << static_cast<float>(leafBlocksSize()) / (1024.0f * 1024.0f)
+            << "MB)" << std::endl;
+}
+
+constexpr uint32_t BVH_CACHE_VERSION = 1;
+constexpr uint64_t BVH_CACHE_ALIGNMENT = 64;
+
+struct BVHCacheHeader {
+  char magic[4];
+  uint32_t version;
+  uint64_t meshHash;
+  uint32_t buildMode;
+  uint32_t nodeSize;
+  uint32_t leafBlockSize;
+  uint32_t nodesCount;
+  uint32_t leafBlocksCount;
+  uint32_t indicesCount;
+  uint64_t nodesOffset;
+  uint64_t leafBlocksOffset;
+  uint64_t indicesOffset;
+};
+
+static uint64_t fnv1a(const void *pData, size_t size, uint64_t hash) {
+  auto bytes = static_cast<const unsigned char *>(pData);
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+static uint64_t meshContentHash(const cmesh4::SimpleMesh &mesh,
+                                BVHBuildMode mode) {
+  uint64_t hash = 14695981039346656037ull;
+  hash = fnv1a(mesh.vPos4f.data(), mesh.vPos4f.size() * sizeof(float4), hash);
+  hash = fnv1a(mesh.indices.data(), mesh.indices.size() * sizeof(uint32_t),
+               hash);
+  return fnv1a(&mode, sizeof(mode), hash);
+}
+
+static uint64_t alignOffset(uint64_t offset) {
+  return (offset + BVH_CACHE_ALIGNMENT - 1) / BVH_CACHE_ALIGNMENT *
+         BVH_CACHE_ALIGNMENT;
+}
+
+bool BVHBuilder::loadCache(const std::string &cachePath, uint64_t meshHash) {
+  MappedFile file;
+  try {
+    file = MappedFile(cachePath);
+  } catch (const std::runtime_error &) {
+    return false;
+  }
+
+  BVHCacheHeader header;
+  if (file.size() < sizeof(header)) {
+    return false;
+  }
+  // written without offset + bytes, which can wrap around
+  auto fitsFile = [&file](uint64_t offset, uint64_t bytes) {
+    return offset <= file.size() && bytes <= file.size() - offset;
+  };
+  std::memcpy(&header, file.data(), sizeof(header));
+  if (std::memcmp(header.magic, "BVH8", 4) != 0 ||
+      header.version != BVH_CACHE_VERSION || header.meshHash != meshHash ||
+      header.buildMode != static_cast<uint32_t>(buildMode) ||
+      header.nodeSize != sizeof(BVH8Node) ||
+      header.leafBlockSize != sizeof(TriangleLeaf8) ||
+      header.indicesCount != m_mesh.indices.size() ||
+      header.nodesCount == 0 ||
+      header.nodesOffset % alignof(BVH8Node) != 0 ||
+      header.leafBlocksOffset % alignof(TriangleLeaf8) != 0 ||
+      !fitsFile(header.nodesOffset, header.nodesCount * sizeof(BVH8Node)) ||
+      !fitsFile(header.leafBlocksOffset,
+                header.leafBlocksCount * sizeof(TriangleLeaf8)) ||
+      !fitsFile(header.indicesOffset,
+                header.indicesCount * sizeof(uint32_t))) {
+    return false;
+  }
+
+  std::span<const BVH8Node> nodes = {
+      reinterpret_cast<const BVH8Node *>(file.data() + header.nodesOffset),
+      header.nodesCount};
+  // children follow their parent, so a stale cache can not form cycles
+  for (uint32_t nodeID = 0; nodeID < nodes.size(); ++nodeID) {
+    auto &node = nodes[nodeID];
+    // a bool holding anything but 0 or 1 can not even be read
+    uint8_t isLeafByte = 0;
+    std::memcpy(&isLeafByte, &node.isLeaf, 1);
+    if (isLeafByte > 1) {
+      return false;
+    }
+    bool valid = node.isLeaf
+                     ? node.leafInfo.blockIndex < header.leafBlocksCount &&
+                           node.leafInfo.startIndex <= header.indicesCount &&
+                           node.leafInfo.count <=
+                               header.indicesCount - node.leafInfo.startIndex
+                     : node.children.realCount >= 1 &&
+                           node.children.realCount <= 8 &&
+                           node.children.offset > nodeID &&
+                           node.children.offset <= header.nodesCount &&
+                           node.children.realCount <=
+                               header.nodesCount - node.children.offset;
+    if (!valid) {
+      return false;
+    }
+  }
+
+  m_nodes.clear();
+  m_leafBlocks.clear();
+  m_nodesView = nodes;
+  m_leafBlocksView = {reinterpret_cast<const TriangleLeaf8 *>(
+                          file.data() + header.leafBlocksOffset),
+                      header.leafBlocksCount};
+  std::memcpy(m_mesh.indices.data(), file.data() + header.indicesOffset,
+              header.indicesCount * sizeof(uint32_t));
+  m_cacheFile = std::move(file);
+  return true;
+}
+
+void BVHBuilder::saveCache(const std::string &cachePath,
+                           uint64_t meshHash) const {
+  BVHCacheHeader header = {};
+  std::memcpy(header.magic, "BVH8", 4);
+  header.version = BVH_CACHE_VERSION;
+  header.meshHash = meshHash;
+  header.buildMode = static_cast<uint32_t>(buildMode);
+  header.nodeSize = sizeof(BVH8Node);
+  header.leafBlockSize = sizeof(TriangleLeaf8);
+  header.nodesCount = static_cast<uint32_t>(m_nodesView.size());
+  header.leafBlocksCount = static_cast<uint32_t>(m_leafBlocksView.size());
+  header.indicesCount = static_cast<uint32_t>(m_mesh.indices.size());
+  header.nodesOffset = alignOffset(sizeof(header));
+  header.leafBlocksOffset =
+      alignOffset(header.nodesOffset + m_nodesView.size_bytes());
+  header.indicesOffset =
+      alignOffset(header.leafBlocksOffset + m_leafBlocksView.size_bytes());
+
+  // write to a temporary file first, so a crash never leaves a torn cache
+  std::string tmpPath = cachePath + ".tmp";
+  std::ofstream fs(tmpPath, std::ios::binary);
+  auto writeAt = [&fs](uint64_t offset, const void *pData, size_t size) {
+    static const char zeros[BVH_CACHE_ALIGNMENT] = {};
+    auto padding = static_cast<std::streamsize>(offset) - fs.tellp();
+    fs.write(zeros, padding);
+    fs.write(static_cast<const char *>(pData),
+             static_cast<std::streamsize>(size));
+  };
+  writeAt(0, &header, sizeof(header));
+  writeAt(header.nodesOffset, m_nodesView.data(), m_nodesView.size_bytes());
+  writeAt(header.leafBlocksOffset, m_leafBlocksView.data(),
+          m_leafBlocksView.size_bytes());
+  writeAt(header.indicesOffset, m_mesh.indices.data(),
+          m_mesh.indices.size() * sizeof(uint32_t));
+  fs.close();
+  if (!fs) {
+    std::remove(tmpPath.c_str());
+    std::cout << "Can not write BVH cache " << cachePath << std::endl;
+    return;
+  }
+  if (std::rename(tmpPath.c_str(), cachePath.c_str()) != 0) {
+    std::remove(tmpPath.c_str());
+    std::cout << "Can not write BVH cache " << cachePath << std::endl;
+  }
+}
+
+void BVHBuilder::performCached(cmesh4::SimpleMesh mesh,
+                               const std::string &cachePath) {
+  auto b = std::chrono::high_resolution_clock::now();
+  uint64_t meshHash = meshContentHash(mesh, buildMode);
+  m_mesh = std::move(mesh);
+  if (loadCache(cachePath, meshHash)) {
+    auto e = std::chrono::high_resolution_clock::now();
+    float t = static_cast<float>(std::chrono::duration_cast<std::chrono::microseconds>(e-b).count())/1e3f;
+    std::cout << "BVH loaded from " << cachePath << ": " << t << "ms"
+              << std::endl;
+  } else {
+    build(std::move(m_mesh));
+    saveCache(cachePath, meshHash);
+  }
+  applyNodeLayout();
+}
+
+static CompressedBVH8Node compressNode(const BVH8Node &node,
+                                       std::span<const BVH8Node> nodes,
+                                       std::span<const uint32_t> remap) {
+  CompressedBVH8Node result = {};
+  auto &boxes = node.children.boxes;
+  uint32_t count = node.children.realCount;
+  const float *childMin[3] = {boxes.xMin, boxes.yMin, boxes.zMin};
+  const float *childMax[3] = {boxes.xMax, boxes.yMax, boxes.zMax};
+  uint8_t *qMin[3] = {result.qMinX, result.qMinY, result.qMinZ};
+  uint8_t *qMax[3] = {result.qMaxX, result.qMaxY, result.qMaxZ};
+
+  for (int axis = 0; axis < 3; ++axis) {
+    float lo = *std::min_element(childMin[axis], childMin[axis] + count);
+    float hi = *std::max_element(childMax[axis], childMax[axis] + count);
+    // smallest power of 2 step that fits the node extent into 255 steps
+    int exponent = -100;
+    if (hi > lo) {
+      exponent = static_cast<int>(std::ceil(std::log2((hi - lo) / 255.0f)));
+      while ((hi - lo) / std::ldexp(1.0f, exponent) > 255.0f) {
+        ++exponent;
+      }
+    }
+    float step = std::ldexp(1.0f, exponent);
+    result.origin[axis] = lo;
+    result.exponent[axis] = static_cast<int8_t>(exponent);
+    for (uint32_t child = 0; child < count; ++child) {
+      float qLo = std::floor((childMin[axis][child] - lo) / step);
+      float qHi = std::ceil((childMax[axis][child] - lo) / step);
+      qMin[axis][child] = static_cast<uint8_t>(std::clamp(qLo, 0.0f, 255.0f));
+      qMax[axis][child] = static_cast<uint8_t>(std::clamp(qHi, 0.0f, 255.0f));
+    }
+  }
+
+  result.childCount = static_cast<uint8_t>(count);
+  for (uint32_t child = 0; child < count; ++child) {
+    auto &childNode = nodes[node.children.offset + child];
+    if (childNode.isLeaf) {
+      result.leafMask = static_cast<uint8_t>(result.leafMask | (1u << child));
+      result.child[child] = childNode.leafInfo.blockIndex;
+      result.trianglesCount[child] =
+          static_cast<uint8_t>(std::min(childNode.leafInfo.count / 3, 8u));
+    } else {
+      result.child[child] = remap[node.children.offset + child];
+    }
+  }
+  return result;
+}
+
+void BVHBuilder::applyNodeLayout() {
+  m_compressedNodes.clear();
+  if (nodeLayout != BVHNodeLayout::Compressed || m_nodesView.empty()) {
+    return;
+  }
+
+  // only inner nodes get a compressed node, leaves are referenced directly
+  std::vector<uint32_t> remap(m_nodesView.size(), 0);
+  uint32_t innerCount = 0;
+  for (size_t index = 0; index < m_nodesView.size(); ++index) {
+    if (!m_nodesView[index].isLeaf) {
+      remap[index] = innerCount++;
+    }
+  }
+
+  if (m_nodesView[0].isLeaf) {
+    // tiny mesh: wrap the single leaf into a root with one child
+    BVH8Node root;
+    BBox3f box = calc_bbox(m_mesh);
+    root.children.realCount = 1;
+    root.children.offset = 0;
+    root.children.boxes.xMin[0] = box.boxMin.x;
+    root.children.boxes.yMin[0] = box.boxMin.y;
+    root.children.boxes.zMin[0] = box.boxMin.z;
+    root.children.boxes.xMax[0] = box.boxMax.x;
+    root.children.boxes.yMax[0] = box.boxMax.y;
+    root.children.boxes.zMax[0] = box.boxMax.z;
+    m_compressedNodes.push_back(compressNode(root, m_nodesView, remap));
+  } else {
+    m_compressedNodes.resize(innerCount);
+    for (size_t index = 0; index < m_nodesView.size(); ++index) {
+      if (!m_nodesView[index].isLeaf) {
+        m_compressedNodes[remap[index]] =
+            compressNode(m_nodesView[index], m_nodesView, remap);
+      }
+    }
+  }
+
+  std::cout << "Compressed BVH nodes: " << m_compressedNodes.size() << " ("
+            << static_cast<float>(m_compressedNodes.size() *
+                                  sizeof(CompressedBVH8Node)) /
+                   (1024.0f * 1024.0f)
+            << "MB, full layout "
+            << static_cast<float>(m_nodesView.size_bytes()) /
+                   (1024.0f * 1024.0f)
+            << "MB)" << std::endl;
+
+  // full nodes are not touched anymore, a mapped cache keeps them paged out
+  m_nodes.clear();
+  m_nodes.shrink_to_fit();
+  m_nodesView = {};
+}
+
+float BVHBuilder::sahCost() const {
+  if (m_nodesView.empty()) {
+    return 0.0f;
+  }
+
+  // expected cost of a random ray hitting the root box, box8 tests are
+  // weighted as EMPTY_NODE_TRAVERSE_COST and triangle tests as 1
+  float rootArea = surfaceArea(calc_bbox(m_mesh));
+  float cost = 0.0f;
+  std::vector<std::pair<size_t, float>> stack = {{0, rootArea}};
+  while (!stack.empty()) {
+    auto [index, area] = stack.back();
+    stack.pop_back();
+    auto &node = m_nodesView[index];
+    if (node.isLeaf) {
+      cost += area / rootArea * static_cast<float>(node.leafInfo.count / 3);
+      continue;
+    }
+    cost += area / rootArea * EMPTY_NODE_TRAVERSE_COST;
+    auto &boxes = node.children.boxes;
+    for (size_t child = 0; child < node.children.realCount; ++child) {
+      BBox3f childBox{float3{boxes.xMin[child], boxes.yMin[child], boxes.zMin[child]},
+                      float3{boxes.xMax[child], boxes.yMax[child], boxes.zMax[child]}};
+      stack.push_back({node.children.offset + child, surfaceArea(childBox)});
+    }
+  }
+  return cost;
 }
 
 HitInfo BVHBuilder::intersect(const LiteMath::float3 &rayPos,
                               const LiteMath::float3 &rayDir, float tNear,
                               float tFar) const {
+  if (nodeLayout == BVHNodeLayout::Compressed) {
+    return traverseCompressed(0, 0, rayPos, rayDir, tNear, tFar, false);
+  }
   return traverseNode(0, rayPos, rayDir, tNear, tFar);
 }
 
+constexpr size_t TRAVERSAL_STACK_SIZE = 128;
+
 HitInfo BVHBuilder::traverseNode(size_t index, LiteMath::float3 rayPos,
                                  LiteMath::float3 rayDir, float tNear,
                                  float tFar) const {
-  auto &node = m_nodes[index];
   HitInfo result;
-  if (!node.isLeaf) {
+  float closest = tFar; // nothing farther than the best hit is visited
+  float3 invDir = 1.0f / rayDir;
+
+  struct StackEntry {
+    size_t nodeID;
+    float t;
+  };
+  StackEntry stack[TRAVERSAL_STACK_SIZE];
+  size_t stackSize = 0;
+  stack[stackSize++] = {index, tNear};
+
+  while (stackSize > 0) {
+    auto [nodeID, tEntry] = stack[--stackSize];
+    if (tEntry > closest) {
+      continue;
+    }
+
+    auto &node = m_nodesView[nodeID];
+    if (node.isLeaf) {
+      uint32_t trianglesCount = std::min(node.leafInfo.count / 3, 8u);
+      ispc::HitInfo8 hits;
+      ispc::intersect_1_ray_leaf_8(
+          reinterpret_cast<const ispc::TriangleLeaf8 *>(
+              &m_leafBlocksView[node.leafInfo.blockIndex]),
+          rayPos.M, rayDir.M, &hits);
+
+      for (size_t trID = 0; trID < trianglesCount; ++trID) {
+        if (hits.hitten[trID] && hits.t[trID] >= tNear &&
+            hits.t[trID] < closest) {
+          closest = hits.t[trID];
+          result.hitten = true;
+          result.normal = {hits.norm_x[trID], hits.norm_y[trID],
+                           hits.norm_z[trID]};
+          result.t = hits.t[trID];
+        }
+      }
+      continue;
+    }
+
     float t[8] = {};
-    float3 invDir = 1.0f / rayDir;
     ispc::intersect_box_8(
         reinterpret_cast<const ispc::Box8 *>(&node.children.boxes), rayPos.M,
-        invDir.M, tNear, tFar, t);
+        invDir.M, tNear, closest, t);
     size_t children[8] = {0, 1, 2, 3, 4, 5, 6, 7};
+    for (size_t i = 0; i < 8; ++i) {
+      if (i >= node.children.realCount || t[i] < 0) {
+        t[i] = std::numeric_limits<float>::infinity();
+      }
+    }
     sort8(t, children);
 
+    // push far to near, so the nearest child is popped first
+    for (size_t i = 8; i-- > 0;) {
+      if (std::isinf(t[i])) {
+        continue;
+      }
+      size_t childNodeID = node.children.offset + children[i];
+      if (stackSize == TRAVERSAL_STACK_SIZE) [[unlikely]] {
+        HitInfo cur = traverseNode(childNodeID, rayPos, rayDir, tNear, closest);
+        if (cur.hitten && cur.t < closest) {
+          closest = cur.t;
+          result = cur;
+        }
+        continue;
+      }
+      stack[stackSize++] = {childNodeID, t[i]};
+    }
+  }
+
+  return result;
+}
+
+HitInfo BVHBuilder::traverseCompressed(uint32_t index, uint32_t trianglesCount,
+                                       LiteMath::float3 rayPos,
+                                       LiteMath::float3 rayDir, float tNear,
+                                       float tFar, bool anyHit) const {
+  HitInfo result;
+  float closest = tFar;
+  float3 invDir = 1.0f / rayDir;
+
+  struct StackEntry {
+    uint32_t index;
+    uint32_t trianglesCount; // 0 for inner nodes
+    float t;
+  };
+  StackEntry stack[TRAVERSAL_STACK_SIZE];
+  size_t stackSize = 0;
+  stack[stackSize++] = {index, trianglesCount, tNear};
+
+  while (stackSize > 0) {
+    auto [nodeID, nodeTriangles, tEntry] = stack[--stackSize];
+    if (tEntry > closest) {
+      continue;
+    }
+
+    if (nodeTriangles > 0) {
+      ispc::HitInfo8 hits;
+      ispc::intersect_1_ray_leaf_8(
+          reinterpret_cast<const ispc::TriangleLeaf8 *>(
+              &m_leafBlocksView[nodeID]),
+          rayPos.M, rayDir.M, &hits);
+      for (size_t trID = 0; trID < nodeTriangles; ++trID) {
+        if (hits.hitten[trID] && hits.t[trID] >= tNear &&
+            hits.t[trID] < closest) {
+          closest = hits.t[trID];
+          result.hitten = true;
+          result.normal = {hits.norm_x[trID], hits.norm_y[trID],
+                           hits.norm_z[trID]};
+          result.t = hits.t[trID];
+          if (anyHit) {
+            return result;
+          }
+        }
+      }
+      continue;
+    }
+
+    auto &node = m_compressedNodes[nodeID];
+    float t[8] = {};
+    ispc::intersect_compressed_box_8(
+        reinterpret_cast<const ispc::CompressedBVH8Node *>(&node), rayPos.M,
+        invDir.M, tNear, closest, t);
+    size_t children[8] = {0, 1, 2, 3, 4, 5, 6, 7};
     for (size_t i = 0; i < 8; ++i) {
+      if (t[i] < 0) {
+        t[i] = std::numeric_limits<float>::infinity();
+      }
+    }
+    if (!anyHit) {
+      sort8(t, children);
+    }
+
+    for (size_t i = 8; i-- > 0;) {
+      if (std::isinf(t[i])) {
+        continue;
+      }
       size_t childID = children[i];
-      if (childID >= node.children.realCount || (t[i] < 0) ||
-          (result.hitten && result.t < t[i]))
+      uint32_t childTriangles = ((node.leafMask >> childID) & 1u)
+                                    ? node.trianglesCount[childID]
+                                    : 0u;
+      if (stackSize == TRAVERSAL_STACK_SIZE) [[unlikely]] {
+        HitInfo cur = traverseCompressed(node.child[childID], childTriangles,
+                                         rayPos, rayDir, tNear, closest, anyHit);
+        if (cur.hitten && cur.t < closest) {
+          closest = cur.t;
+          result = cur;
+          if (anyHit) {
+            return result;
+          }
+        }
         continue;
+      }
+      stack[stackSize++] = {node.child[childID], childTriangles, t[i]};
+    }
+  }
+
+  return result;
+}
 
-      HitInfo cur = traverseNode(node.children.offset + childID, rayPos, rayDir,
-                                 tNear, tFar);
-      if (cur.hitten && (!result.hitten || result.t > cur.t)) {
-        result = cur;
+bool BVHBuilder::occluded(const LiteMath::float3 &rayPos,
+                          const LiteMath::float3 &rayDir, float tNear,
+                          float tFar) const {
+  if (nodeLayout == BVHNodeLayout::Compressed) {
+    return traverseCompressed(0, 0, rayPos, rayDir, tNear, tFar, true).hitten;
+  }
+  return occludedNode(0, rayPos, rayDir, 1.0f / rayDir, tNear, tFar);
+}
+
+bool BVHBuilder::occludedNode(size_t index, const LiteMath::float3 &rayPos,
+                              const LiteMath::float3 &rayDir,
+                              const LiteMath::float3 &invDir, float tNear,
+                              float tFar) const {
+  auto &node = m_nodesView[index];
+  if (!node.isLeaf) {
+    float t[8] = {};
+    ispc::intersect_box_8(
+        reinterpret_cast<const ispc::Box8 *>(&node.children.boxes), rayPos.M,
+        invDir.M, tNear, tFar, t);
+    // any hit will do, so children are visited in storage order
+    for (size_t childID = 0; childID < node.children.realCount; ++childID) {
+      if (t[childID] >= 0 &&
+          occludedNode(node.children.offset + childID, rayPos, rayDir, invDir,
+                       tNear, tFar)) {
+        return true;
       }
     }
-  } else {
-    uint32_t start = node.leafInfo.startIndex;
-    uint32_t end = start + node.leafInfo.count;
-    uint32_t trianglesCount = (end - start) / 3;
-    assert(trianglesCount <= 8);
-    trianglesCount = std::min(trianglesCount, 8u);
-
-    ispc::Triangle8 triagles = {};
-    for (uint32_t trID = 0; trID < trianglesCount; ++trID) {
-      uint32_t i0 = m_mesh.indices[start + trID * 3];
-      uint32_t i1 = m_mesh.indices[start + trID * 3 + 1];
-      uint32_t i2 = m_mesh.indices[start + trID * 3 + 2];
-      float4 v0 = m_mesh.vPos4f[i0];
-      float4 v1 = m_mesh.vPos4f[i1];
-      float4 v2 = m_mesh.vPos4f[i2];
-      v0 /= v0.w;
-      v1 /= v1.w;
-      v2 /= v2.w;
-
-      triagles.v0.x[trID] = v0.x;
-      triagles.v0.y[trID] = v0.y;
-      triagles.v0.z[trID] = v0.z;
-      triagles.v1.x[trID] = v1.x;
-      triagles.v1.y[trID] = v1.y;
-      triagles.v1.z[trID] = v1.z;
-      triagles.v2.x[trID] = v2.x;
-      triagles.v2.y[trID] = v2.y;
-      triagles.v2.z[trID] = v2.z;
-    }
-    ispc::HitInfo8 hits;
-    ispc::intersect_1_ray_8_triangles(&triagles, rayPos.M, rayDir.M, &hits);
-
-    for (size_t trID = 0; trID < trianglesCount; ++trID) {
-      if (hits.hitten[trID] && (!result.hitten || result.t > hits.t[trID])) {
-        result.hitten = true;
-        result.normal = {hits.norm_x[trID], hits.norm_y[trID],
-                         hits.norm_z[trID]};
-        result.t = hits.t[trID];
+    return false;
+  }
+
+  uint32_t trianglesCount = std::min(node.leafInfo.count / 3, 8u);
+  ispc::HitInfo8 hits;
+  ispc::intersect_1_ray_leaf_8(reinterpret_cast<const ispc::TriangleLeaf8 *>(
+                                   &m_leafBlocksView[node.leafInfo.blockIndex]),
+                               rayPos.M, rayDir.M, &hits);
+  for (size_t trID = 0; trID < trianglesCount; ++trID) {
+    if (hits.hitten[trID] && hits.t[trID] >= tNear && hits.t[trID] <= tFar) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// closest point of the triangle (a, a + e1, a + e2), Ericson's
+// region classification
+static float3 closestTrianglePoint(const float3 &p, const float3 &a,
+                                   const float3 &e1, const float3 &e2) {
+  float3 ap = p - a;
+  float d1 = dot(e1, ap);
+  float d2 = dot(e2, ap);
+  if (d1 <= 0.0f && d2 <= 0.0f) {
+    return a;
+  }
+  float3 bp = ap - e1;
+  float d3 = dot(e1, bp);
+  float d4 = dot(e2, bp);
+  if (d3 >= 0.0f && d4 <= d3) {
+    return a + e1;
+  }
+  float vc = d1 * d4 - d3 * d2;
+  if (vc <= 0.0f && d1 >= 0.0f && d3 <= 0.0f) {
+    return a + e1 * (d1 / (d1 - d3));
+  }
+  float3 cp = ap - e2;
+  float d5 = dot(e1, cp);
+  float d6 = dot(e2, cp);
+  if (d6 >= 0.0f && d5 <= d6) {
+    return a + e2;
+  }
+  float vb = d5 * d2 - d1 * d6;
+  if (vb <= 0.0f && d2 >= 0.0f && d6 <= 0.0f) {
+    return a + e2 * (d2 / (d2 - d6));
+  }
+  float va = d3 * d6 - d5 * d4;
+  if (va <= 0.0f && d4 - d3 >= 0.0f && d5 - d6 >= 0.0f) {
+    float w = (d4 - d3) / ((d4 - d3) + (d5 - d6));
+    return a + e1 + (e2 - e1) * w;
+  }
+  float denom = 1.0f / (va + vb + vc);
+  return a + e1 * (vb * denom) + e2 * (vc * denom);
+}
+
+ClosestPoint BVHBuilder::closestPoint(const LiteMath::float3 &point,
+                                      float maxDistance) const {
+  if (nodeLayout == BVHNodeLayout::Compressed) {
+    throw std::logic_error(
+        "Closest point queries need the full BVH node layout");
+  }
+  ClosestPoint closest;
+  closest.distance = maxDistance;
+  closestPointNode(0, point, closest);
+  if (closest.distance >= maxDistance) {
+    closest.distance = std::numeric_limits<float>::infinity();
+  }
+  return closest;
+}
+
+void BVHBuilder::closestPointNode(size_t index, const LiteMath::float3 &point,
+                                  ClosestPoint &closest) const {
+  // squared distances are compared, the result is rooted at the end
+  float closest2 = closest.distance * closest.distance;
+
+  struct StackEntry {
+    size_t nodeID;
+    float distance2;
+  };
+  StackEntry stack[TRAVERSAL_STACK_SIZE];
+  size_t stackSize = 0;
+  stack[stackSize++] = {index, 0.0f};
+
+  while (stackSize > 0) {
+    auto [nodeID, entryDistance2] = stack[--stackSize];
+    if (entryDistance2 >= closest2) {
+      continue;
+    }
+
+    auto &node = m_nodesView[nodeID];
+    if (node.isLeaf) {
+      uint32_t trianglesCount = std::min(node.leafInfo.count / 3, 8u);
+      auto &leaf = m_leafBlocksView[node.leafInfo.blockIndex];
+      for (size_t trID = 0; trID < trianglesCount; ++trID) {
+        float3 v0{leaf.v0.x[trID], leaf.v0.y[trID], leaf.v0.z[trID]};
+        float3 normal{leaf.normal.x[trID], leaf.normal.y[trID],
+                      leaf.normal.z[trID]};
+        // the plane is never farther than the triangle
+        float planeDistance = dot(point - v0, normal);
+        if (planeDistance * planeDistance >= closest2) {
+          continue;
+        }
+        float3 e1{leaf.e1.x[trID], leaf.e1.y[trID], leaf.e1.z[trID]};
+        float3 e2{leaf.e2.x[trID], leaf.e2.y[trID], leaf.e2.z[trID]};
+        float3 candidate = closestTrianglePoint(point, v0, e1, e2);
+        float3 offset = candidate - point;
+        float distance2 = dot(offset, offset);
+        if (distance2 < closest2) {
+          closest2 = distance2;
+          closest.point = candidate;
+        }
+      }
+      continue;
+    }
+
+    auto &boxes = node.children.boxes;
+    float d[8] = {};
+    size_t children[8] = {0, 1, 2, 3, 4, 5, 6, 7};
+    for (size_t i = 0; i < 8; ++i) {
+      if (i >= node.children.realCount) {
+        d[i] = std::numeric_limits<float>::infinity();
+        continue;
+      }
+      float dx = std::max({boxes.xMin[i] - point.x, 0.0f,
+                           point.x - boxes.xMax[i]});
+      float dy = std::max({boxes.yMin[i] - point.y, 0.0f,
+                           point.y - boxes.yMax[i]});
+      float dz = std::max({boxes.zMin[i] - point.z, 0.0f,
+                           point.z - boxes.zMax[i]});
+      d[i] = dx * dx + dy * dy + dz * dz;
+    }
+    sort8(d, children);
+
+    // push far to near, so the nearest child is popped first
+    for (size_t i = 8; i-- > 0;) {
+      if (d[i] >= closest2) {
+        continue;
+      }
+      size_t childNodeID = node.children.offset + children[i];
+      if (stackSize == TRAVERSAL_STACK_SIZE) [[unlikely]] {
+        closest.distance = std::sqrt(closest2);
+        closestPointNode(childNodeID, point, closest);
+        closest2 = closest.distance * closest.distance;
+        continue;
       }
+      stack[stackSize++] = {childNodeID, d[i]};
     }
   }
 
-  return result;
+  closest.distance = std::sqrt(closest2);
+}
+
+// packets with fewer active rays are finished one ray at a time
+constexpr int PACKET_MIN_ACTIVE_RAYS = 3;
+constexpr size_t PACKET_STACK_SIZE = 256;
+
+void BVHBuilder::intersect8(const Ray8 &rays, uint32_t laneMask,
+                            const float tNear[8], const float tFar[8],
+                            HitInfo hits[8]) const {
+  if (nodeLayout == BVHNodeLayout::Compressed) {
+    // packets are only implemented for the full node layout
+    for (size_t lane = 0; lane < 8; ++lane) {
+      if ((laneMask >> lane) & 1u) {
+        hits[lane] = traverseCompressed(0, 0, rays.pos(lane), rays.dir(lane),
+                                        tNear[lane], tFar[lane], false);
+      }
+    }
+    return;
+  }
+
+  auto pRays = reinterpret_cast<const ispc::Ray8 *>(&rays);
+  ispc::HitInfo8 packetHits = {};
+  for (size_t lane = 0; lane < 8; ++lane) {
+    packetHits.t[lane] = tFar[lane];
+  }
+
+  auto traceSingle = [&](uint32_t nodeID, uint32_t mask) {
+    for (size_t lane = 0; lane < 8; ++lane) {
+      if (((mask >> lane) & 1u) == 0) {
+        continue;
+      }
+      HitInfo cur = traverseNode(nodeID, rays.pos(lane), rays.dir(lane),
+                                 tNear[lane], packetHits.t[lane]);
+      if (cur.hitten && cur.t >= tNear[lane] && cur.t < packetHits.t[lane]) {
+        packetHits.hitten[lane] = 1;
+        packetHits.t[lane] = cur.t;
+        packetHits.norm_x[lane] = cur.normal.x;
+        packetHits.norm_y[lane] = cur.normal.y;
+        packetHits.norm_z[lane] = cur.normal.z;
+      }
+    }
+  };
+
+  struct StackEntry {
+    uint32_t nodeID;
+    uint32_t mask;
+    float tEntry[8]; // entry distance of every lane in the mask
+  };
+  StackEntry stack[PACKET_STACK_SIZE];
+  size_t stackSize = 0;
+  stack[stackSize] = {0, laneMask, {}};
+  std::copy_n(tNear, 8, stack[stackSize++].tEntry);
+
+  while (stackSize > 0) {
+    const StackEntry &entry = stack[--stackSize];
+    uint32_t nodeID = entry.nodeID;
+    // lanes that found a closer hit since the push leave the packet
+    uint32_t mask = entry.mask;
+    for (uint32_t lane = 0; lane < 8; ++lane) {
+      if (((mask >> lane) & 1u) && entry.tEntry[lane] > packetHits.t[lane]) {
+        mask &= ~(1u << lane);
+      }
+    }
+    if (mask == 0) {
+      continue;
+    }
+    if (std::popcount(mask) < PACKET_MIN_ACTIVE_RAYS) {
+      traceSingle(nodeID, mask);
+      continue;
+    }
+
+    auto &node = m_nodesView[nodeID];
+    if (node.isLeaf) {
+      uint32_t trianglesCount = std::min(node.leafInfo.count / 3, 8u);
+      ispc::intersect_8_rays_leaf_8(
+          reinterpret_cast<const ispc::TriangleLeaf8 *>(
+              &m_leafBlocksView[node.leafInfo.blockIndex]),
+          trianglesCount, pRays, mask, tNear, &packetHits);
+      continue;
+    }
+
+    float t[8] = {};
+    uint32_t masks[8] = {};
+    float entries[64] = {};
+    ispc::intersect_8_rays_box_8(
+        reinterpret_cast<const ispc::Box8 *>(&node.children.boxes), pRays,
+        mask, tNear, packetHits.t, t, masks, entries);
+    size_t children[8] = {0, 1, 2, 3, 4, 5, 6, 7};
+    for (size_t i = 0; i < 8; ++i) {
+      if (i >= node.children.realCount || masks[i] == 0) {
+        t[i] = std::numeric_limits<float>::infinity();
+      }
+    }
+    sort8(t, children);
+
+    // push far to near, so the nearest child is popped first
+    for (size_t i = 8; i-- > 0;) {
+      if (std::isinf(t[i])) {
+        continue;
+      }
+      size_t childID = children[i];
+      auto childNodeID =
+          static_cast<uint32_t>(node.children.offset + childID);
+      if (stackSize == PACKET_STACK_SIZE) {
+        traceSingle(childNodeID, masks[childID]);
+        continue;
+      }
+      stack[stackSize] = {childNodeID, masks[childID], {}};
+      std::copy_n(entries + childID * 8, 8, stack[stackSize++].tEntry);
+    }
+  }
+
+  for (size_t lane = 0; lane < 8; ++lane) {
+    if (((laneMask >> lane) & 1u) == 0) {
+      continue;
+    }
+    hits[lane] = HitInfo{};
+    if (packetHits.hitten[lane]) {
+      hits[lane].hitten = true;
+      hits[lane].t = packetHits.t[lane];
+      hits[lane].normal = {packetHits.norm_x[lane], packetHits.norm_y[lane],
+                           packetHits.norm_z[lane]};
+    }
+  }
+}
+
+void BVHBuilder::intersect(std::span<const Ray> rays,
+                           std::span<HitInfo> hits) const {
+  for (size_t first = 0; first < rays.size(); first += 8) {
+    Ray8 packet = {};
+    float tNear[8] = {};
+    float tFar[8] = {};
+    uint32_t laneMask = 0;
+    size_t count = std::min<size_t>(8, rays.size() - first);
+    for (size_t lane = 0; lane < count; ++lane) {
+      const Ray &ray = rays[first + lane];
+      packet.origX[lane] = ray.pos.x;
+      packet.origY[lane] = ray.pos.y;
+      packet.origZ[lane] = ray.pos.z;
+      packet.dirX[lane] = ray.dir.x;
+      packet.dirY[lane] = ray.dir.y;
+      packet.dirZ[lane] = ray.dir.z;
+      tNear[lane] = ray.tNear;
+      tFar[lane] = ray.tFar;
+      laneMask |= 1u << lane;
+    }
+    intersect8(packet, laneMask, tNear, tFar, hits.data() + first);
+  }
 }
\ No newline at end of file
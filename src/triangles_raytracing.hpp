@@ -4,6 +4,7 @@
 #include <LiteMath/LiteMath.h>
 
 #include "camera.hpp"
+#include "mapped_file.hpp"
 #include "mesh.h"
 #include "raytracing.hpp"
 
@@ -16,9 +17,42 @@ struct Box8 {
   float zMax[8];
 };
 
+// packet of 8 rays in SoA layout, mirrors ispc::Ray8
+struct Ray8 {
+  float origX[8];
+  float origY[8];
+  float origZ[8];
+  float dirX[8];
+  float dirY[8];
+  float dirZ[8];
+
+  LiteMath::float3 pos(size_t lane) const noexcept {
+    return {origX[lane], origY[lane], origZ[lane]};
+  }
+  LiteMath::float3 dir(size_t lane) const noexcept {
+    return {dirX[lane], dirY[lane], dirZ[lane]};
+  }
+};
+
+struct Point8 {
+  float x[8];
+  float y[8];
+  float z[8];
+};
+
+// dehomogenized leaf triangles with precomputed edges and normals,
+// mirrors ispc::TriangleLeaf8
+struct alignas(32) TriangleLeaf8 {
+  Point8 v0;
+  Point8 e1; // v1 - v0
+  Point8 e2; // v2 - v0
+  Point8 normal;
+};
+
 struct BVHLeafInfo {
   uint32_t startIndex;
   uint32_t count;
+  uint32_t blockIndex; // index into BVHBuilder leaf blocks
 };
 
 struct BVH8ChildrenInfo {
@@ -35,14 +69,71 @@ struct BVH8Node {
   bool isLeaf = false;
 };
 
+// BVH8 node with child boxes quantized to 8 bits per coordinate relative to
+// the node origin: boxMin = origin + qMin * 2^exponent, rounded outwards.
+// Mirrors ispc::CompressedBVH8Node, two cache lines per node.
+struct alignas(64) CompressedBVH8Node {
+  float origin[3];
+  int8_t exponent[3];
+  uint8_t leafMask; // bit i set: child[i] is a leaf block index
+  uint8_t childCount;
+  uint8_t padding[3];
+  uint8_t trianglesCount[8];
+  uint32_t child[8]; // compressed node index or leaf block index
+  uint8_t qMinX[8];
+  uint8_t qMinY[8];
+  uint8_t qMinZ[8];
+  uint8_t qMaxX[8];
+  uint8_t qMaxY[8];
+  uint8_t qMaxZ[8];
+};
+
+enum class BVHNodeLayout { Full, Compressed };
+
+struct ClosestPoint {
+  float distance = std::numeric_limits<float>::infinity();
+  LiteMath::float3 point;
+};
+
+enum class BVHBuildMode {
+  SortedSAH, // full sort along every axis per split candidate
+  BinnedSAH  // centroid binning, O(n) per split candidate
+};
+
 class BVHBuilder final: public IScene {
+public:
+  BVHBuildMode buildMode = BVHBuildMode::SortedSAH;
+  BVHNodeLayout nodeLayout = BVHNodeLayout::Full;
+
 public:
   void perform(cmesh4::SimpleMesh mesh);
+  // maps the tree from cachePath if it was built for the same mesh,
+  // otherwise builds it and rewrites the cache
+  void performCached(cmesh4::SimpleMesh mesh, const std::string &cachePath);
   HitInfo intersect(const LiteMath::float3 &rayPos,
                     const LiteMath::float3 &rayDir, float tNear,
                     float tFar) const override;
+  bool occluded(const LiteMath::float3 &rayPos, const LiteMath::float3 &rayDir,
+                float tNear, float tFar) const override;
+  void intersect(std::span<const Ray> rays,
+                 std::span<HitInfo> hits) const override;
+  // lanes not set in laneMask are left untouched
+  void intersect8(const Ray8 &rays, uint32_t laneMask, const float tNear[8],
+                  const float tFar[8], HitInfo hits[8]) const;
+  // nearest surface point not farther than maxDistance, the distance stays
+  // infinite if there is none. Needs the full node layout.
+  ClosestPoint closestPoint(
+      const LiteMath::float3 &point,
+      float maxDistance = std::numeric_limits<float>::infinity()) const;
   cmesh4::SimpleMesh &&result() { return std::move(m_mesh); }
-  size_t nodesCount() const noexcept { return m_nodes.size(); }
+  size_t nodesCount() const noexcept {
+    return (nodeLayout == BVHNodeLayout::Compressed) ? m_compressedNodes.size()
+                                                     : m_nodesView.size();
+  }
+  float sahCost() const;
+  size_t leafBlocksSize() const noexcept {
+    return m_leafBlocksView.size() * sizeof(TriangleLeaf8);
+  }
 
 private:
   struct DivisionResult {
@@ -53,12 +144,34 @@ private:
   DivisionResult tryDivide(size_t start, size_t end);
   DivisionResult tryDivide(std::vector<uint32_t> &indices, size_t start,
                            size_t end, uint32_t axes);
+  DivisionResult tryDivideBinned(size_t start, size_t end);
   void createNode(size_t offset, size_t start, size_t end);
+  void build(cmesh4::SimpleMesh mesh);
+  void applyNodeLayout();
+  // starts at a compressed node, or at a leaf block if trianglesCount > 0
+  HitInfo traverseCompressed(uint32_t index, uint32_t trianglesCount,
+                             LiteMath::float3 rayPos, LiteMath::float3 rayDir,
+                             float tNear, float tFar, bool anyHit) const;
+  bool loadCache(const std::string &cachePath, uint64_t meshHash);
+  void saveCache(const std::string &cachePath, uint64_t meshHash) const;
   HitInfo traverseNode(size_t index, LiteMath::float3 rayPos,
                        LiteMath::float3 rayDir, float tNear, float tFar) const;
+  bool occludedNode(size_t index, const LiteMath::float3 &rayPos,
+                    const LiteMath::float3 &rayDir,
+                    const LiteMath::float3 &invDir, float tNear,
+                    float tFar) const;
+  void closestPointNode(size_t index, const LiteMath::float3 &point,
+                        ClosestPoint &closest) const;
 
 private:
+  // traversal reads the tree through views, which point either at the
+  // vectors below or into the mapped cache file
+  std::span<const BVH8Node> m_nodesView;
+  std::span<const TriangleLeaf8> m_leafBlocksView;
   std::vector<BVH8Node> m_nodes;
+  std::vector<TriangleLeaf8> m_leafBlocks;
+  std::vector<CompressedBVH8Node> m_compressedNodes;
+  MappedFile m_cacheFile;
   std::vector<LiteMath::BBox3f> m_leftBoxes;
   std::vector<LiteMath::BBox3f> m_rightBoxes;
   std::vector<uint32_t> m_indicesY;
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "LiteMath/LiteMath.h"
+
+// Trilinear interpolation of 8 cell corners. Corners are ordered as
+// (x << 2) + (y << 1) + z, coords are local to the cell, in [0, 1].
+
+struct SDFSample {
+  float value = 0.0f;
+  LiteMath::float3 gradient; // with respect to the cell local coords
+};
+
+inline float trilinear(const float corners[8],
+                       const LiteMath::float3 &coords) noexcept {
+  float c00 = corners[0] + (corners[1] - corners[0]) * coords.z;
+  float c01 = corners[2] + (corners[3] - corners[2]) * coords.z;
+  float c10 = corners[4] + (corners[5] - corners[4]) * coords.z;
+  float c11 = corners[6] + (corners[7] - corners[6]) * coords.z;
+  float c0 = c00 + (c01 - c00) * coords.y;
+  float c1 = c10 + (c11 - c10) * coords.y;
+  return c0 + (c1 - c0) * coords.x;
+}
+
+// value and analytic gradient from a single corners fetch
+inline SDFSample trilinearWithGradient(const float corners[8],
+                                       const LiteMath::float3 &coords) noexcept {
+  float c00 = corners[0] + (corners[1] - corners[0]) * coords.z;
+  float c01 = corners[2] + (corners[3] - corners[2]) * coords.z;
+  float c10 = corners[4] + (corners[5] - corners[4]) * coords.z;
+  float c11 = corners[6] + (corners[7] - corners[6]) * coords.z;
+  float c0 = c00 + (c01 - c00) * coords.y;
+  float c1 = c10 + (c11 - c10) * coords.y;
+
+  float d0 = (corners[1] - corners[0]) +
+             ((corners[3] - corners[2]) - (corners[1] - corners[0])) * coords.y;
+  float d1 = (corners[5] - corners[4]) +
+             ((corners[7] - corners[6]) - (corners[5] - corners[4])) * coords.y;
+
+  SDFSample result;
+  result.value = c0 + (c1 - c0) * coords.x;
+  result.gradient.x = c1 - c0;
+  result.gradient.y = (c01 - c00) + ((c11 - c10) - (c01 - c00)) * coords.x;
+  result.gradient.z = d0 + (d1 - d0) * coords.x;
+  return result;
+}
@@ -0,0 +1,97 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+
+#include "brick_raytracing.hpp"
+#include "test_utils.hpp"
+
+using namespace LiteMath;
+
+// mirrors the header written by saveSDFBrickGrid
+struct BrickGridHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t brickSize;
+  uint32_t storedBricks;
+  uint32_t size[3];
+  uint32_t bricksCount[3];
+};
+
+static bool sameSize(uint3 a, uint3 b) {
+  return a.x == b.x && a.y == b.y && a.z == b.z;
+}
+
+static HitInfo traceCenter(const IScene &scene) {
+  return scene.intersect(float3{0.1f, 0.2f, 3.0f}, float3{0.0f, 0.0f, -1.0f},
+                         0.0f, 100.0f);
+}
+
+int main() {
+  SDFGrid grid;
+  grid.setValues(uint3{33, 33, 33}, sphereValues(33, 0.5f));
+  SDFBrickGrid bricks;
+  convertSDFGrid(grid, bricks);
+  CHECK(bricks.bricksCount.x == 4);
+  CHECK(bricks.storedBricks() > 0);
+  CHECK(bricks.storedBricks() < bricks.brickIndices.size());
+
+  const std::string path = "brick_grid_test.bricks";
+  saveSDFBrickGrid(bricks, path);
+  SDFBrickGrid loaded;
+  loadSDFBrickGrid(loaded, path);
+  CHECK(sameSize(loaded.size, bricks.size));
+  CHECK(sameSize(loaded.bricksCount, bricks.bricksCount));
+  CHECK(loaded.brickIndices == bricks.brickIndices);
+  CHECK(loaded.coarseValues == bricks.coarseValues);
+  CHECK(loaded.brickValues == bricks.brickValues);
+
+  // the sparse grid hits the surface where the dense one does
+  HitInfo denseHit = traceCenter(grid);
+  HitInfo sparseHit = traceCenter(loaded);
+  CHECK(denseHit.hitten && sparseHit.hitten);
+  CHECK(std::abs(denseHit.t - sparseHit.t) < 1e-3f);
+
+  auto valid = readBytes(path);
+  auto header = readAt<BrickGridHeader>(valid, 0);
+  size_t coarseCount = bricks.brickIndices.size();
+  auto firstStored = static_cast<size_t>(
+      std::find_if(bricks.brickIndices.begin(), bricks.brickIndices.end(),
+                   [](uint32_t index) { return index != EMPTY_BRICK; }) -
+      bricks.brickIndices.begin());
+  std::vector<std::vector<char>> broken = {
+      {},
+      std::vector<char>(valid.begin(), valid.end() - 4),
+      patched(valid, offsetof(BrickGridHeader, magic), uint32_t{0}),
+      patched(valid, offsetof(BrickGridHeader, version), uint32_t{7}),
+      patched(valid, offsetof(BrickGridHeader, brickSize), BRICK_SIZE * 2),
+      patched(valid, offsetof(BrickGridHeader, size), uint32_t{1}),
+      patched(valid, offsetof(BrickGridHeader, size), uint32_t{100000}),
+      patched(valid, offsetof(BrickGridHeader, bricksCount), uint32_t{1}),
+      patched(valid, offsetof(BrickGridHeader, storedBricks),
+              static_cast<uint32_t>(coarseCount + 1)),
+      patched(valid, sizeof(BrickGridHeader) + firstStored * sizeof(uint32_t),
+              header.storedBricks),
+  };
+  for (auto &bytes : broken) {
+    writeBytes(path, bytes);
+    CHECK(throwsRuntimeError([&] {
+      SDFBrickGrid scene;
+      loadSDFBrickGrid(scene, path);
+    }));
+  }
+
+  // empty bricks with zero coarse distance are outside of the surface,
+  // only negative ones put the ray inside
+  SDFGrid far;
+  far.setValues(uint3{9, 9, 9}, std::vector<float>(9 * 9 * 9, 1.0f));
+  SDFBrickGrid empty;
+  convertSDFGrid(far, empty);
+  CHECK(empty.storedBricks() == 0);
+  empty.coarseValues.assign(empty.coarseValues.size(), 0.0f);
+  CHECK(!traceCenter(empty).hitten);
+  empty.coarseValues.assign(empty.coarseValues.size(), -1.0f);
+  CHECK(traceCenter(empty).hitten);
+
+  std::remove(path.c_str());
+  return finishTest();
+}
@@ -0,0 +1,131 @@
+#include <cmath>
+#include <cstddef>
+#include <filesystem>
+
+#include "scene_loader.hpp"
+#include "test_utils.hpp"
+#include "triangles_raytracing.hpp"
+
+using namespace LiteMath;
+
+// mirrors the header written by BVHBuilder::saveCache
+struct BVHCacheHeader {
+  char magic[4];
+  uint32_t version;
+  uint64_t meshHash;
+  uint32_t buildMode;
+  uint32_t nodeSize;
+  uint32_t leafBlockSize;
+  uint32_t nodesCount;
+  uint32_t leafBlocksCount;
+  uint32_t indicesCount;
+  uint64_t nodesOffset;
+  uint64_t leafBlocksOffset;
+  uint64_t indicesOffset;
+};
+
+// closest hits of a fan of rays through the mesh, -1 for misses
+static std::vector<float> traceFan(const BVHBuilder &bvh) {
+  std::vector<float> result;
+  for (int y = -8; y <= 8; ++y) {
+    for (int x = -8; x <= 8; ++x) {
+      float3 dir = normalize(float3{static_cast<float>(x) * 0.05f,
+                                    static_cast<float>(y) * 0.05f, -1.0f});
+      HitInfo hit = bvh.intersect(float3{0.0f, 0.0f, 3.0f}, dir, 0.0f, 100.0f);
+      result.push_back(hit.hitten ? hit.t : -1.0f);
+    }
+  }
+  return result;
+}
+
+static bool sameHits(const std::vector<float> &a, const std::vector<float> &b) {
+  if (a.size() != b.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < a.size(); ++i) {
+    if (std::abs(a[i] - b[i]) > 1e-5f) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static std::vector<char> patchedNode(const std::vector<char> &bytes,
+                                     size_t nodeID, auto &&patch) {
+  auto header = readAt<BVHCacheHeader>(bytes, 0);
+  size_t offset = header.nodesOffset + nodeID * sizeof(BVH8Node);
+  auto node = readAt<BVH8Node>(bytes, offset);
+  patch(node);
+  return patched(bytes, offset, node);
+}
+
+int main(int argc, char **argv) {
+  std::string resources = argc > 1 ? argv[1] : "resources";
+  auto mesh = loadAndScale(resources + "/spot.obj");
+  const std::string cachePath = "bvh_cache_test.bvh";
+  std::filesystem::remove(cachePath);
+
+  BVHBuilder built;
+  built.performCached(mesh, cachePath);
+  auto expected = traceFan(built);
+  auto valid = readBytes(cachePath);
+  CHECK(valid.size() > sizeof(BVHCacheHeader));
+  auto header = readAt<BVHCacheHeader>(valid, 0);
+  CHECK(std::memcmp(header.magic, "BVH8", 4) == 0);
+  CHECK(header.nodesCount == built.nodesCount());
+
+  // an intact cache is mapped as it is
+  auto writeTime = std::filesystem::last_write_time(cachePath);
+  {
+    BVHBuilder cached;
+    cached.performCached(mesh, cachePath);
+    CHECK(cached.nodesCount() == built.nodesCount());
+    CHECK(sameHits(traceFan(cached), expected));
+  }
+  CHECK(std::filesystem::last_write_time(cachePath) == writeTime);
+
+  size_t leafID = 0;
+  while (leafID < header.nodesCount &&
+         !readAt<BVH8Node>(valid, header.nodesOffset +
+                                      leafID * sizeof(BVH8Node))
+              .isLeaf) {
+    ++leafID;
+  }
+  CHECK(leafID < header.nodesCount);
+
+  // every broken cache is rebuilt and rewritten instead of traversed
+  std::vector<std::vector<char>> broken = {
+      std::vector<char>(valid.begin(), valid.begin() + std::ssize(valid) / 2),
+      patched(valid, offsetof(BVHCacheHeader, nodesOffset),
+              header.nodesOffset + 4),
+      patched(valid, offsetof(BVHCacheHeader, leafBlocksOffset),
+              ~uint64_t{0} - 31),
+      patched(valid, offsetof(BVHCacheHeader, indicesOffset),
+              ~uint64_t{0} - 3),
+      patchedNode(valid, 0, [](BVH8Node &node) { node.children.offset = 0; }),
+      patchedNode(valid, 0,
+                  [](BVH8Node &node) { node.children.realCount = 9; }),
+      patchedNode(valid, 0,
+                  [&](BVH8Node &node) {
+                    node.children.offset = header.nodesCount - 1;
+                  }),
+      patchedNode(valid, leafID,
+                  [&](BVH8Node &node) {
+                    node.leafInfo.blockIndex = header.leafBlocksCount;
+                  }),
+      patchedNode(valid, leafID,
+                  [&](BVH8Node &node) {
+                    node.leafInfo.startIndex = header.indicesCount;
+                  }),
+  };
+  for (auto &bytes : broken) {
+    writeBytes(cachePath, bytes);
+    BVHBuilder rebuilt;
+    rebuilt.performCached(mesh, cachePath);
+    CHECK(sameHits(traceFan(rebuilt), expected));
+    CHECK(readBytes(cachePath) != bytes);
+  }
+
+  std::filesystem::remove(cachePath);
+  return finishTest();
+}
@@ -0,0 +1,107 @@
+#include <cmath>
+
+#include "grid_raytracing.hpp"
+#include "test_utils.hpp"
+
+using namespace LiteMath;
+
+constexpr float SPHERE_RADIUS = 0.5f;
+
+static HitInfo trace(const SDFGrid &grid, float3 rayPos, float3 rayDir) {
+  return grid.intersect(rayPos, normalize(rayDir), 0.0f, 100.0f);
+}
+
+int main() {
+  // values of a plane are linear, so the trilinear surface is the plane
+  // itself and the roots are exact
+  {
+    const uint32_t gridSize = 9;
+    std::vector<float> values;
+    for (uint32_t x = 0; x < gridSize; ++x) {
+      for (uint32_t y = 0; y < gridSize; ++y) {
+        for (uint32_t z = 0; z < gridSize; ++z) {
+          float pz =
+              static_cast<float>(z) / static_cast<float>(gridSize - 1) * 2.0f -
+              1.0f;
+          values.push_back(pz - 0.3f);
+        }
+      }
+    }
+    SDFGrid plane;
+    plane.setValues(uint3{gridSize, gridSize, gridSize}, std::move(values));
+    plane.intersectionMode = SDFGridIntersection::ExactCells;
+    for (int i = -4; i <= 4; ++i) {
+      float3 dir =
+          normalize(float3{static_cast<float>(i) * 0.08f, 0.05f, -1.0f});
+      HitInfo hit =
+          plane.intersect(float3{0.0f, 0.0f, 3.0f}, dir, 0.0f, 100.0f);
+      CHECK(hit.hitten);
+      CHECK(std::abs(hit.t - 2.7f / -dir.z) < 1e-4f);
+    }
+  }
+
+  // the only cell has 1 at the corners with x == y and -2 at the others, so
+  // along its xy diagonal the values are 6s^2-6s+1: positive at both faces
+  // and negative between the roots (3 -+ sqrt(3))/6
+  {
+    std::vector<float> values(8);
+    for (uint32_t corner = 0; corner < 8; ++corner) {
+      uint32_t x = (corner >> 2) & 1;
+      uint32_t y = (corner >> 1) & 1;
+      values[corner] = x == y ? 1.0f : -2.0f;
+    }
+    SDFGrid saddle;
+    saddle.setValues(uint3{2, 2, 2}, std::move(values));
+    saddle.intersectionMode = SDFGridIntersection::ExactCells;
+    HitInfo hit = trace(saddle, float3{-1.5f, -1.5f, 0.0f},
+                        float3{1.0f, 1.0f, 0.0f});
+    float root = (3.0f - std::sqrt(3.0f)) / 6.0f;
+    CHECK(hit.hitten);
+    CHECK(std::abs(hit.t - std::sqrt(2.0f) * (0.5f + 2.0f * root)) < 1e-4f);
+    // along z the values are constant, positive near the x == y corners
+    CHECK(!trace(saddle, float3{-0.8f, -0.8f, 3.0f}, float3{0.0f, 0.0f, -1.0f})
+               .hitten);
+  }
+
+  // sphere hits lie on the trilinear surface, close to the sphere, and just
+  // behind the sphere tracing ones
+  {
+    const uint32_t gridSize = 33;
+    SDFGrid exact;
+    exact.setValues(uint3{gridSize, gridSize, gridSize},
+                    sphereValues(gridSize, SPHERE_RADIUS));
+    exact.intersectionMode = SDFGridIntersection::ExactCells;
+    SDFGrid traced;
+    traced.setValues(uint3{gridSize, gridSize, gridSize},
+                     sphereValues(gridSize, SPHERE_RADIUS));
+    traced.intersectionMode = SDFGridIntersection::SphereTracing;
+    size_t hitsCount = 0;
+    for (int y = -8; y <= 8; ++y) {
+      for (int x = -8; x <= 8; ++x) {
+        float3 rayPos = float3{0.0f, 0.0f, 3.0f};
+        float3 dir = normalize(float3{static_cast<float>(x) * 0.025f,
+                                      static_cast<float>(y) * 0.025f, -1.0f});
+        HitInfo hit = exact.intersect(rayPos, dir, 0.0f, 100.0f);
+        HitInfo reference = traced.intersect(rayPos, dir, 0.0f, 100.0f);
+        float closest = length(rayPos - dir * dot(rayPos, dir));
+        if (closest > SPHERE_RADIUS + 0.05f) {
+          CHECK(!hit.hitten);
+        }
+        if (!hit.hitten) {
+          continue;
+        }
+        ++hitsCount;
+        float3 hitPoint = rayPos + dir * hit.t;
+        CHECK(std::abs(exact.sdf(hitPoint)) < 1e-4f);
+        CHECK(std::abs(length(hitPoint) - SPHERE_RADIUS) < 0.01f);
+        // sphere tracing stops once the value is below its hit epsilon, so
+        // in front of the root, further at grazing angles
+        CHECK(reference.hitten && reference.t <= hit.t + 1e-5f &&
+              hit.t - reference.t < 0.01f);
+      }
+    }
+    CHECK(hitsCount > 0);
+  }
+
+  return finishTest();
+}
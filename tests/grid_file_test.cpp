@@ -0,0 +1,142 @@
+#include <cstddef>
+#include <cstdio>
+
+#include "grid_raytracing.hpp"
+#include "test_utils.hpp"
+
+using namespace LiteMath;
+
+// mirror the headers written by saveSDFGrid
+struct GridHeader {
+  char magic[4];
+  uint32_t version;
+  uint32_t size[3];
+  uint32_t levelsCount;
+  uint64_t valuesOffset;
+  uint64_t levelsOffset;
+};
+
+struct GridLevelHeader {
+  uint32_t blockSize;
+  uint32_t size[3];
+  uint64_t valuesOffset;
+};
+
+static bool sameValues(const SDFGrid &a, const SDFGrid &b) {
+  if (a.size.x != b.size.x || a.size.y != b.size.y || a.size.z != b.size.z) {
+    return false;
+  }
+  for (uint32_t x = 0; x < a.size.x; ++x) {
+    for (uint32_t y = 0; y < a.size.y; ++y) {
+      for (uint32_t z = 0; z < a.size.z; ++z) {
+        if (a.sdf(uint3{x, y, z}) != b.sdf(uint3{x, y, z})) {
+          return false;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+static bool sameLevels(const SDFGrid &a, const SDFGrid &b) {
+  if (a.levels.size() != b.levels.size()) {
+    return false;
+  }
+  for (size_t levelID = 0; levelID < a.levels.size(); ++levelID) {
+    if (a.levels[levelID].blockSize != b.levels[levelID].blockSize ||
+        a.levels[levelID].minValues != b.levels[levelID].minValues) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool rejects(const std::string &path, const std::vector<char> &bytes) {
+  writeBytes(path, bytes);
+  return throwsRuntimeError([&] {
+    SDFGrid scene;
+    loadSDFGrid(scene, path);
+  });
+}
+
+int main() {
+  const uint32_t gridSize = 21;
+  SDFGrid grid;
+  grid.setValues(uint3{gridSize, gridSize, gridSize},
+                 sphereValues(gridSize, 0.5f));
+  grid.buildPyramid();
+  CHECK(!grid.levels.empty());
+
+  const std::string path = "grid_file_test.grid";
+  saveSDFGrid(grid, path);
+  {
+    SDFGrid loaded;
+    loadSDFGrid(loaded, path);
+    CHECK(sameValues(loaded, grid));
+    CHECK(sameLevels(loaded, grid));
+  }
+
+  // tiled grids are written in the linear file order
+  {
+    SDFGrid tiled;
+    tiled.setValues(uint3{gridSize, gridSize, gridSize},
+                    sphereValues(gridSize, 0.5f));
+    tiled.setLayout(SDFGridLayout::Tiled);
+    saveSDFGrid(tiled, path);
+    SDFGrid loaded;
+    loadSDFGrid(loaded, path);
+    CHECK(loaded.layout() == SDFGridLayout::Linear);
+    CHECK(sameValues(loaded, grid));
+  }
+
+  // legacy files are three sizes and the values, the pyramid is rebuilt
+  auto values = sphereValues(gridSize, 0.5f);
+  std::vector<char> legacy(3 * sizeof(uint32_t) +
+                           values.size() * sizeof(float));
+  for (size_t axis = 0; axis < 3; ++axis) {
+    legacy = patched(legacy, axis * sizeof(uint32_t), gridSize);
+  }
+  std::memcpy(legacy.data() + 3 * sizeof(uint32_t), values.data(),
+              values.size() * sizeof(float));
+  writeBytes(path, legacy);
+  {
+    SDFGrid loaded;
+    loadSDFGrid(loaded, path);
+    CHECK(sameValues(loaded, grid));
+    CHECK(sameLevels(loaded, grid));
+  }
+  CHECK(rejects(path, {}));
+  CHECK(rejects(path, std::vector<char>(legacy.begin(), legacy.end() - 4)));
+  CHECK(rejects(path, patched(legacy, 0, uint32_t{1})));
+  CHECK(rejects(path, patched(legacy, 0, uint32_t{1u << 31})));
+
+  saveSDFGrid(grid, path);
+  auto valid = readBytes(path);
+  auto header = readAt<GridHeader>(valid, 0);
+  size_t levelAt = header.levelsOffset;
+  auto level = readAt<GridLevelHeader>(valid, levelAt);
+  std::vector<std::vector<char>> broken = {
+      std::vector<char>(valid.begin(), valid.begin() + sizeof(GridHeader)),
+      patched(valid, offsetof(GridHeader, version), uint32_t{3}),
+      patched(valid, offsetof(GridHeader, size), uint32_t{1}),
+      patched(valid, offsetof(GridHeader, size), uint32_t{1u << 30}),
+      patched(valid, offsetof(GridHeader, valuesOffset), uint64_t{0}),
+      patched(valid, offsetof(GridHeader, valuesOffset),
+              header.valuesOffset + 2),
+      patched(valid, offsetof(GridHeader, valuesOffset), ~uint64_t{0} - 3),
+      patched(valid, offsetof(GridHeader, levelsOffset), ~uint64_t{0} - 7),
+      patched(valid, offsetof(GridHeader, levelsCount), ~uint32_t{0}),
+      patched(valid, levelAt + offsetof(GridLevelHeader, blockSize),
+              uint32_t{0}),
+      patched(valid, levelAt + offsetof(GridLevelHeader, size),
+              level.size[0] + 1),
+      patched(valid, levelAt + offsetof(GridLevelHeader, valuesOffset),
+              ~uint64_t{0} - 3),
+  };
+  for (auto &bytes : broken) {
+    CHECK(rejects(path, bytes));
+  }
+
+  std::remove(path.c_str());
+  return finishTest();
+}
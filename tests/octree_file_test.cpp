@@ -0,0 +1,221 @@
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+
+#include "octree_raytracing.hpp"
+#include "test_utils.hpp"
+
+using namespace LiteMath;
+
+constexpr float SPHERE_RADIUS = 0.5f;
+constexpr uint32_t SPHERE_DEPTH = 4;
+
+static float sphereSDF(float3 point) { return length(point) - SPHERE_RADIUS; }
+
+// child and corner i of a node are at (x<<2)|(y<<1)|z of its box
+static float3 cornerOffset(uint32_t i) {
+  return float3{static_cast<float>((i >> 2) & 1),
+                static_cast<float>((i >> 1) & 1), static_cast<float>(i & 1)};
+}
+
+// nodes near the sphere surface are split down to SPHERE_DEPTH. Children
+// are placed right after the subtree of their previous sibling when
+// depthFirst is set, level by level otherwise.
+static std::vector<SDFOctreeNode> sphereOctree(bool depthFirst) {
+  struct Pending {
+    uint32_t nodeID;
+    float3 boxMin;
+    float size;
+    uint32_t depth;
+  };
+  std::vector<SDFOctreeNode> nodes(1);
+  std::vector<Pending> pending = {{0, float3{-1.0f}, 2.0f, 0}};
+  while (!pending.empty()) {
+    Pending next = depthFirst ? pending.back() : pending.front();
+    if (depthFirst) {
+      pending.pop_back();
+    } else {
+      pending.erase(pending.begin());
+    }
+    auto &node = nodes[next.nodeID];
+    for (uint32_t i = 0; i < 8; ++i) {
+      node.values[i] = sphereSDF(next.boxMin + cornerOffset(i) * next.size);
+    }
+    float3 center = next.boxMin + float3{next.size * 0.5f};
+    bool nearSurface =
+        std::abs(sphereSDF(center)) < next.size * std::sqrt(3.0f) * 0.5f;
+    if (next.depth == SPHERE_DEPTH || !nearSurface) {
+      continue;
+    }
+    auto offset = static_cast<uint32_t>(nodes.size());
+    node.childrenOffset = offset;
+    nodes.resize(nodes.size() + 8);
+    // depth first children are pushed reversed, so child 0 is popped first
+    for (uint32_t i = 0; i < 8; ++i) {
+      uint32_t child = depthFirst ? 7 - i : i;
+      float childSize = next.size * 0.5f;
+      pending.push_back({offset + child,
+                         next.boxMin + cornerOffset(child) * childSize,
+                         childSize, next.depth + 1});
+    }
+  }
+  return nodes;
+}
+
+// chain of inner nodes, child 0 of each of them is split again
+static std::vector<SDFOctreeNode> chainOctree(uint32_t innerCount) {
+  std::vector<SDFOctreeNode> nodes(1 + 8 * static_cast<size_t>(innerCount));
+  for (auto &node : nodes) {
+    std::fill(node.values, node.values + 8, 100.0f);
+  }
+  uint32_t nodeID = 0;
+  for (uint32_t level = 0; level < innerCount; ++level) {
+    nodes[nodeID].childrenOffset = 1 + 8 * level;
+    nodeID = nodes[nodeID].childrenOffset;
+  }
+  return nodes;
+}
+
+// closest hits of a fan of rays through the sphere, -1 for misses
+static std::vector<float> traceFan(const SDFOctree &octree) {
+  std::vector<float> result;
+  for (int y = -8; y <= 8; ++y) {
+    for (int x = -8; x <= 8; ++x) {
+      float3 dir = normalize(float3{static_cast<float>(x) * 0.025f,
+                                    static_cast<float>(y) * 0.025f, -1.0f});
+      HitInfo hit =
+          octree.intersect(float3{0.0f, 0.0f, 3.0f}, dir, 0.0f, 100.0f);
+      result.push_back(hit.hitten ? hit.t : -1.0f);
+    }
+  }
+  return result;
+}
+
+static bool sameHits(const std::vector<float> &a, const std::vector<float> &b,
+                     float eps) {
+  if (a.size() != b.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < a.size(); ++i) {
+    if (std::abs(a[i] - b[i]) > eps) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool loadThrows(const std::vector<SDFOctreeNode> &nodes,
+                       const std::string &path) {
+  saveSDFOctree(nodes, path);
+  SDFOctree octree;
+  return throwsRuntimeError([&] { loadSDFOctree(octree, path); });
+}
+
+int main() {
+  const std::string path = "octree_file_test.octree";
+  auto breadthFirst = sphereOctree(false);
+  auto depthFirst = sphereOctree(true);
+  CHECK(breadthFirst.size() == depthFirst.size());
+  CHECK(breadthFirst.size() > 8);
+
+  SDFOctree reference;
+  reference.setNodes(breadthFirst);
+  CHECK(reference.nodesCount() == breadthFirst.size());
+  auto expected = traceFan(reference);
+
+  // rays passing clearly inside of the sphere hit it close to the surface,
+  // the ones passing clearly outside miss it
+  size_t hitsCount = 0;
+  for (int y = -8, i = 0; y <= 8; ++y) {
+    for (int x = -8; x <= 8; ++x, ++i) {
+      float3 rayPos = float3{0.0f, 0.0f, 3.0f};
+      float3 dir = normalize(float3{static_cast<float>(x) * 0.025f,
+                                    static_cast<float>(y) * 0.025f, -1.0f});
+      float closest = length(rayPos - dir * dot(rayPos, dir));
+      if (closest < SPHERE_RADIUS - 0.05f) {
+        ++hitsCount;
+        CHECK(expected[i] >= 0.0f);
+        CHECK(std::abs(sphereSDF(rayPos + dir * expected[i])) < 0.02f);
+      } else if (closest > SPHERE_RADIUS + 0.05f) {
+        CHECK(expected[i] < 0.0f);
+      }
+    }
+  }
+  CHECK(hitsCount > 0);
+
+  // a file in depth first order is renumbered into the same tree
+  {
+    SDFOctree renumbered;
+    renumbered.setNodes(depthFirst);
+    CHECK(renumbered.nodesCount() == reference.nodesCount());
+    CHECK(renumbered.leavesCount() == reference.leavesCount());
+    CHECK(sameHits(traceFan(renumbered), expected, 1e-6f));
+  }
+
+  // save and load keep the tree for both orders
+  for (auto *nodes : {&breadthFirst, &depthFirst}) {
+    saveSDFOctree(*nodes, path);
+    CHECK(readBytes(path).size() ==
+          sizeof(uint32_t) + nodes->size() * sizeof(SDFOctreeNode));
+    SDFOctree loaded;
+    loadSDFOctree(loaded, path);
+    CHECK(loaded.nodesCount() == reference.nodesCount());
+    CHECK(loaded.leavesCount() == reference.leavesCount());
+    CHECK(sameHits(traceFan(loaded), expected, 1e-6f));
+  }
+
+  // ropes follow the renumbered tree
+  {
+    SDFOctree roped;
+    roped.setNodes(depthFirst);
+    roped.buildRopes();
+    roped.traversal = OctreeTraversal::Ropes;
+    CHECK(sameHits(traceFan(roped), expected, 1e-4f));
+  }
+
+  // the deepest tree the traversal stack holds loads, a deeper one throws
+  {
+    SDFOctree deep;
+    deep.setNodes(chainOctree(OCTREE_MAX_DEPTH));
+    CHECK(deep.nodesCount() == 1 + 8 * size_t{OCTREE_MAX_DEPTH});
+    CHECK(!deep
+               .intersect(float3{-0.99f, -0.99f, 3.0f},
+                          float3{0.0f, 0.0f, -1.0f}, 0.0f, 100.0f)
+               .hitten);
+    CHECK(loadThrows(chainOctree(OCTREE_MAX_DEPTH + 1), path));
+  }
+
+  // every broken file throws instead of being traversed
+  saveSDFOctree(breadthFirst, path);
+  auto valid = readBytes(path);
+  auto nodesCount = static_cast<uint32_t>(breadthFirst.size());
+  auto nodeOffset = [](size_t nodeID) {
+    return sizeof(uint32_t) + nodeID * sizeof(SDFOctreeNode) +
+           offsetof(SDFOctreeNode, childrenOffset);
+  };
+  std::vector<std::vector<char>> broken = {
+      {},
+      patched(valid, 0, uint32_t{0}),
+      patched(valid, 0, OCTREE_LEAF_BIT),
+      std::vector<char>(valid.begin(), valid.end() - 1),
+      patched(valid, nodeOffset(0), nodesCount - 7),
+      patched(valid, nodeOffset(0), ~uint32_t{0}),
+      patched(valid, nodeOffset(breadthFirst[0].childrenOffset),
+              breadthFirst[0].childrenOffset),
+  };
+  for (auto &bytes : broken) {
+    writeBytes(path, bytes);
+    SDFOctree octree;
+    CHECK(throwsRuntimeError([&] { loadSDFOctree(octree, path); }));
+  }
+
+  // two inner nodes sharing their children
+  {
+    auto shared = chainOctree(2);
+    shared[2].childrenOffset = shared[1].childrenOffset;
+    CHECK(loadThrows(shared, path));
+  }
+
+  std::remove(path.c_str());
+  return finishTest();
+}
@@ -0,0 +1,69 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+
+#include "grid_raytracing.hpp"
+#include "sdf_quantization.hpp"
+#include "test_utils.hpp"
+
+using namespace LiteMath;
+
+static void checkStorage(SDFStorage storage, float maxCode) {
+  std::vector<float> values = sphereValues(17, 0.5f);
+  const float truncation = 0.25f;
+  QuantizedSDF quantized;
+  auto error = quantizeSDF(values, storage, truncation, quantized);
+  CHECK(quantized.storage == storage);
+  CHECK(std::abs(quantized.scale * maxCode - truncation) < 1e-6f);
+
+  // rounding is at most half a step below the truncation, values beyond it
+  // are clamped to the truncation and keep their sign
+  float maxError = 0.0f;
+  for (size_t i = 0; i < values.size(); ++i) {
+    float decoded = quantized[i];
+    if (std::abs(values[i]) <= truncation) {
+      maxError = std::max(maxError, std::abs(decoded - values[i]));
+    } else {
+      CHECK(std::abs(std::abs(decoded) - truncation) < 1e-6f);
+      CHECK((decoded > 0.0f) == (values[i] > 0.0f));
+    }
+  }
+  CHECK(maxError <= quantized.scale * 0.5f + 1e-6f);
+  CHECK(std::abs(error.maxError - maxError) < 1e-6f);
+  CHECK(error.meanError <= error.maxError);
+
+  // an all zero SDF still has a positive scale and zero codes
+  std::vector<float> zeros(64, 0.0f);
+  quantizeSDF(zeros, storage, 0.0f, quantized);
+  CHECK(quantized.scale > 0.0f);
+  for (size_t i = 0; i < zeros.size(); ++i) {
+    CHECK(quantized[i] == 0.0f);
+  }
+}
+
+int main() {
+  checkStorage(SDFStorage::Int16,
+               static_cast<float>(std::numeric_limits<int16_t>::max()));
+  checkStorage(SDFStorage::Int8,
+               static_cast<float>(std::numeric_limits<int8_t>::max()));
+
+  // the layout is set on float values, a quantized grid can not change it
+  SDFGrid grid;
+  grid.setValues(uint3{17, 17, 17}, sphereValues(17, 0.5f));
+  float center = grid.sdf(uint3{8, 8, 8});
+  grid.setLayout(SDFGridLayout::Tiled);
+  CHECK(grid.sdf(uint3{8, 8, 8}) == center);
+  grid.quantize(SDFStorage::Int16);
+  CHECK(std::abs(grid.sdf(uint3{8, 8, 8}) - center) < 1e-4f);
+  bool thrown = false;
+  try {
+    grid.setLayout(SDFGridLayout::Linear);
+  } catch (const std::logic_error &) {
+    thrown = true;
+  }
+  CHECK(thrown);
+  CHECK(grid.layout() == SDFGridLayout::Tiled);
+
+  return finishTest();
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Tests are plain executables: failed checks are printed and counted, and
+// main returns finishTest() so that ctest sees the failure.
+inline int g_failedChecks = 0;
+
+#define CHECK(condition)                                                       \
+  do {                                                                         \
+    if (!(condition)) {                                                        \
+      std::cerr << __FILE__ << ":" << __LINE__ << ": " << #condition          \
+                << " failed" << std::endl;                                     \
+      ++g_failedChecks;                                                        \
+    }                                                                          \
+  } while (false)
+
+inline int finishTest() {
+  if (g_failedChecks != 0) {
+    std::cerr << g_failedChecks << " checks failed" << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+// true when the loader rejects the file with std::runtime_error
+template <typename Load> bool throwsRuntimeError(Load &&load) {
+  try {
+    load();
+  } catch (const std::runtime_error &) {
+    return true;
+  }
+  return false;
+}
+
+inline std::vector<char> readBytes(const std::string &path) {
+  std::ifstream fs(path, std::ios::binary);
+  return {std::istreambuf_iterator<char>(fs), std::istreambuf_iterator<char>()};
+}
+
+inline void writeBytes(const std::string &path, const std::vector<char> &bytes) {
+  std::ofstream fs(path, std::ios::binary);
+  fs.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+}
+
+template <typename T> T readAt(const std::vector<char> &bytes, size_t offset) {
+  T value;
+  std::memcpy(&value, bytes.data() + offset, sizeof(T));
+  return value;
+}
+
+// copy of the bytes with a value written at offset
+template <typename T>
+std::vector<char> patched(std::vector<char> bytes, size_t offset, T value) {
+  std::memcpy(bytes.data() + offset, &value, sizeof(T));
+  return bytes;
+}
+
+// x-major samples of a sphere SDF over [-1, 1]^3, as stored in .grid files
+inline std::vector<float> sphereValues(uint32_t size, float radius) {
+  std::vector<float> values;
+  values.reserve(static_cast<size_t>(size) * size * size);
+  auto coord = [size](uint32_t i) {
+    return static_cast<float>(i) / static_cast<float>(size - 1) * 2.0f - 1.0f;
+  };
+  for (uint32_t x = 0; x < size; ++x) {
+    for (uint32_t y = 0; y < size; ++y) {
+      for (uint32_t z = 0; z < size; ++z) {
+        float px = coord(x), py = coord(y), pz = coord(z);
+        values.push_back(std::sqrt(px * px + py * py + pz * pz) - radius);
+      }
+    }
+  }
+  return values;
+}